@@ -10,11 +10,19 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/printk.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
 #else
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+/* Userspace shims so the same file builds for the autotest and the benchmarks */
+#define printk(...) fprintf(stderr, __VA_ARGS__)
+#define kvmalloc(size, flags) malloc(size)
+#define kvfree(ptr) free(ptr)
 #endif
 
 #include "aesd-circular-buffer.h"
@@ -22,6 +30,25 @@
 #define BUFFER_SIZE AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 
 
+#ifndef AESD_BYTE_RING
+/**
+ * Copies @param src into the ring slot @param dst, moving inline contents along with it
+ */
+static void copy_entry(struct aesd_buffer_entry *dst, const struct aesd_buffer_entry *src)
+{
+    if (aesd_buffer_entry_is_inline(src))
+    {
+        memcpy(dst->inline_buffer, src->inline_buffer, src->size);
+        dst->buffptr = dst->inline_buffer;
+    }
+    else
+    {
+        dst->buffptr = src->buffptr;
+    }
+    dst->size = src->size;
+}
+#endif
+
 static uint8_t get_number_of_entries(struct aesd_circular_buffer *buffer)
 {
     if (buffer->in_offs > buffer->out_offs)
@@ -38,6 +65,108 @@ static uint8_t get_number_of_entries(struct aesd_circular_buffer *buffer)
     }
 }
 
+#ifdef AESD_BYTE_RING
+
+#define RING_MIN_SIZE 4096
+
+/**
+ * @return the location in the byte ring where an entry of @param size bytes can be stored, treating
+ * the entry overwritten by the next add as free, or NULL if there isn't enough contiguous space.
+ */
+static char *ring_find_space(struct aesd_circular_buffer *buffer, size_t size)
+{
+    uint8_t num_entries = get_number_of_entries(buffer);
+    uint8_t first = buffer->out_offs;
+    const struct aesd_buffer_entry *newest;
+    char *head;
+    char *tail;
+
+    if (buffer->ring == NULL)
+    {
+        return NULL;
+    }
+
+    if (buffer->full)
+    {
+        first = (first + 1) % BUFFER_SIZE;
+        num_entries--;
+    }
+
+    if (num_entries == 0)
+    {
+        return size <= buffer->ring_size ? buffer->ring : NULL;
+    }
+
+    head = (char *)buffer->entry[first].buffptr;
+    newest = &buffer->entry[(buffer->in_offs + BUFFER_SIZE - 1) % BUFFER_SIZE];
+    tail = (char *)newest->buffptr + newest->size;
+
+    if (newest->buffptr >= head)
+    {
+        // Contents are the single segment [head, tail), free space is at the end and the start
+        if (size <= (size_t)(buffer->ring + buffer->ring_size - tail))
+        {
+            return tail;
+        }
+        return size <= (size_t)(head - buffer->ring) ? buffer->ring : NULL;
+    }
+
+    // Contents wrapped, the only free space is between tail and head
+    return size <= (size_t)(head - tail) ? tail : NULL;
+}
+
+/**
+ * Moves the contents of @param buffer into a new ring with room for @param size more bytes.  The ring is
+ * sized at twice what's needed so it only grows again once the entries themselves get bigger.
+ */
+static int ring_grow(struct aesd_circular_buffer *buffer, size_t size)
+{
+    uint8_t num_entries = get_number_of_entries(buffer);
+    size_t needed = 2 * (aesd_circular_buffer_get_num_bytes(buffer) + size);
+    size_t new_size = buffer->ring_size ? buffer->ring_size : RING_MIN_SIZE;
+    char *new_ring;
+    char *dst;
+
+    while (new_size < needed)
+    {
+        new_size *= 2;
+    }
+
+    new_ring = kvmalloc(new_size, GFP_KERNEL);
+    if (new_ring == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    dst = new_ring;
+    for (int i = 0; i < num_entries; ++i)
+    {
+        struct aesd_buffer_entry *entry = &buffer->entry[(buffer->out_offs + i) % BUFFER_SIZE];
+
+        memcpy(dst, entry->buffptr, entry->size);
+        entry->buffptr = dst;
+        dst += entry->size;
+    }
+
+    kvfree(buffer->ring);
+    buffer->ring = new_ring;
+    buffer->ring_size = new_size;
+    return 0;
+}
+
+static char *ring_reserve(struct aesd_circular_buffer *buffer, size_t size)
+{
+    char *dst = ring_find_space(buffer, size);
+
+    if (dst == NULL && ring_grow(buffer, size) == 0)
+    {
+        dst = ring_find_space(buffer, size);
+    }
+    return dst;
+}
+
+#endif /* AESD_BYTE_RING */
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -70,6 +199,49 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
     return NULL;
 }
 
+/**
+ * @param buffer the buffer to search.  Any necessary locking must be performed by caller.
+ * @param char_offset the position to search for, as in aesd_circular_buffer_find_entry_offset_for_fpos
+ * @param span_size_rtn is set to the number of bytes which can be read contiguously from the returned
+ *      pointer.  The span continues into following entries when they are stored back to back, which
+ *      with AESD_BYTE_RING means the whole buffer can be read in at most two spans.
+ * @return a pointer to the byte at char_offset, or NULL if this position is not available in the buffer
+ */
+const char *aesd_circular_buffer_find_span_for_fpos(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t *span_size_rtn)
+{
+    uint8_t num_entries = get_number_of_entries(buffer);
+    struct aesd_buffer_entry *entry;
+    size_t offset_in_entry = 0;
+    uint8_t position;
+    const char *span;
+    size_t span_size;
+
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &offset_in_entry);
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+
+    span = entry->buffptr + offset_in_entry;
+    span_size = entry->size - offset_in_entry;
+    position = (entry - buffer->entry + BUFFER_SIZE - buffer->out_offs) % BUFFER_SIZE;
+
+    for (int i = position + 1; i < num_entries; ++i)
+    {
+        struct aesd_buffer_entry *next = &buffer->entry[(buffer->out_offs + i) % BUFFER_SIZE];
+
+        if (next->buffptr != span + span_size)
+        {
+            break;
+        }
+        span_size += next->size;
+    }
+
+    *span_size_rtn = span_size;
+    return span;
+}
+
 size_t aesd_circular_buffer_get_num_bytes(struct aesd_circular_buffer* buffer)
 {
     uint8_t num_entries = get_number_of_entries(buffer);
@@ -121,28 +293,69 @@ long aesd_circular_buffer_calculate_offset(struct aesd_circular_buffer *buffer,
     return -1;
 }
 
+/**
+ * @param buffer the buffer to index.  Any necessary locking must be performed by caller.
+ * @param entry_index the zero referenced entry to return, counting from the oldest entry
+ * @return the entry at @param entry_index, or NULL if the buffer doesn't hold that many entries
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_get_entry(struct aesd_circular_buffer *buffer, uint32_t entry_index)
+{
+    if (entry_index >= get_number_of_entries(buffer))
+    {
+        return NULL;
+    }
+
+    return &buffer->entry[(buffer->out_offs + entry_index) % BUFFER_SIZE];
+}
+
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
 * If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
 * new start location.
 * Any necessary locking must be handled by the caller
-* Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller,
+* unless it is an inline entry, in which case its contents are copied into the buffer.  With AESD_BYTE_RING the
+* contents of every entry are copied into the ring.
+* @return memory no longer referenced by the buffer which the caller may now free: the buffptr of the entry which
+* was overwritten, or with AESD_BYTE_RING the buffptr of @param add_entry.  NULL if there is nothing to free.
 */
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
+    const char *evicted = NULL;
+#ifdef AESD_BYTE_RING
+    char *dst;
+#endif
+
     if (buffer->full && buffer->in_offs != buffer->out_offs)
     {
         printk("ERROR: buffer is marked full but in_offs = %d, out_offs = %d\n", buffer->in_offs, buffer->out_offs);
-        return;
+        return NULL;
     }
 
-    if (buffer->full)
+#ifdef AESD_BYTE_RING
+    if (!aesd_buffer_entry_is_inline(add_entry))
+    {
+        evicted = add_entry->buffptr;
+    }
+
+    dst = ring_reserve(buffer, add_entry->size);
+    if (dst == NULL)
     {
-        kfree(buffer->entry[buffer->in_offs].buffptr);
+        printk("ERROR: no room in the byte ring for %zu bytes\n", add_entry->size);
+        return evicted;
     }
 
-    buffer->entry[buffer->in_offs].buffptr = add_entry->buffptr;
+    memcpy(dst, add_entry->buffptr, add_entry->size);
+    buffer->entry[buffer->in_offs].buffptr = dst;
     buffer->entry[buffer->in_offs].size = add_entry->size;
+#else
+    if (buffer->full && !aesd_buffer_entry_is_inline(&buffer->entry[buffer->in_offs]))
+    {
+        evicted = buffer->entry[buffer->in_offs].buffptr;
+    }
+
+    copy_entry(&buffer->entry[buffer->in_offs], add_entry);
+#endif
 
     buffer->in_offs++;
 
@@ -150,7 +363,7 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
     if (buffer->in_offs > BUFFER_SIZE)
     {
         printk("ERROR: buffer->in_offs is too big (%d)\n", buffer->in_offs);
-        return;
+        return evicted;
     }
     else if (buffer->in_offs == BUFFER_SIZE)
     {
@@ -166,6 +379,8 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
     {
         buffer->full = true;
     }
+
+    return evicted;
 }
 
 /**
@@ -175,3 +390,89 @@ void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
 }
+
+/**
+* Bulk loads @param count entries from @param entries, oldest first, into @param buffer, replacing
+* its contents.  Any entries beyond AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED are ignored, so callers
+* should skip the oldest ones before passing them in.
+* The caller is responsible for releasing memory referenced by the previous contents of @param buffer,
+* and keeps ownership of memory referenced by @param entries when AESD_CIRCULAR_BUFFER_COPIES_ENTRIES is set.
+* Any necessary locking must be handled by the caller
+* @return 0 on success, or -ENOMEM if the byte ring couldn't be grown, leaving @param buffer empty
+*/
+int aesd_circular_buffer_load(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *entries,
+                              size_t count)
+{
+#ifdef AESD_BYTE_RING
+    char *ring = buffer->ring;
+    size_t ring_size = buffer->ring_size;
+    size_t total = 0;
+#endif
+
+    if (count > BUFFER_SIZE)
+    {
+        count = BUFFER_SIZE;
+    }
+
+    aesd_circular_buffer_init(buffer);
+
+#ifdef AESD_BYTE_RING
+    // Keep the existing ring, grow it once to hold everything, then lay the entries out back to back
+    buffer->ring = ring;
+    buffer->ring_size = ring_size;
+    for (size_t i = 0; i < count; ++i)
+    {
+        total += entries[i].size;
+    }
+
+    if (ring_reserve(buffer, total) == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        aesd_circular_buffer_add_entry(buffer, &entries[i]);
+    }
+#else
+    for (size_t i = 0; i < count; ++i)
+    {
+        copy_entry(&buffer->entry[i], &entries[i]);
+    }
+    buffer->in_offs = count % BUFFER_SIZE;
+    buffer->full = (count == BUFFER_SIZE);
+#endif
+
+    return 0;
+}
+
+/**
+* Makes sure an entry of @param size bytes can be added to @param buffer without allocating.  Only the
+* AESD_BYTE_RING storage ever allocates, otherwise this always succeeds.
+* Any necessary locking must be handled by the caller
+* @return 0 on success, or -ENOMEM
+*/
+int aesd_circular_buffer_reserve(struct aesd_circular_buffer *buffer, size_t size)
+{
+#ifdef AESD_BYTE_RING
+    return ring_reserve(buffer, size) != NULL ? 0 : -ENOMEM;
+#else
+    (void)buffer;
+    (void)size;
+    return 0;
+#endif
+}
+
+/**
+* Releases storage allocated by @param buffer itself.  The buffer must be initialized again before reuse.
+*/
+void aesd_circular_buffer_free_storage(struct aesd_circular_buffer *buffer)
+{
+#ifdef AESD_BYTE_RING
+    kvfree(buffer->ring);
+    buffer->ring = NULL;
+    buffer->ring_size = 0;
+#else
+    (void)buffer;
+#endif
+}
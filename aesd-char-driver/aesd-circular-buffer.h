@@ -16,7 +16,17 @@
 #include <stdbool.h>
 #endif
 
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
+
+/**
+ * Entries of up to this many bytes can be stored inline in their ring slot instead of
+ * in a separate allocation
+ */
+#ifndef AESD_BUFFER_ENTRY_INLINE_SIZE
+#define AESD_BUFFER_ENTRY_INLINE_SIZE 64
+#endif
 
 struct aesd_buffer_entry
 {
@@ -28,8 +38,22 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Storage for entries of up to AESD_BUFFER_ENTRY_INLINE_SIZE bytes.  To add an inline entry
+     * copy its contents here and point buffptr at inline_buffer, the circular buffer copies it
+     * into its own slot.
+     */
+    char inline_buffer[AESD_BUFFER_ENTRY_INLINE_SIZE];
 };
 
+/**
+ * @return true if @param entry holds its contents in inline_buffer rather than memory owned by the caller
+ */
+static inline bool aesd_buffer_entry_is_inline(const struct aesd_buffer_entry *entry)
+{
+    return entry->buffptr == entry->inline_buffer;
+}
+
 struct aesd_circular_buffer
 {
     /**
@@ -49,15 +73,49 @@ struct aesd_circular_buffer
      * set to true when the buffer entry structure is full
      */
     bool full;
+#ifdef AESD_BYTE_RING
+    /**
+     * Contiguous storage for the contents of every entry, allocated on first use and grown as needed.
+     * Entries are stored back to back and never split across the end of the ring, so the contents
+     * form at most two contiguous segments.
+     */
+    char *ring;
+    /**
+     * Size of the allocation at ring
+     */
+    size_t ring_size;
+#endif
 };
 
+/**
+ * Set when the circular buffer copies the contents of every entry it is given into its own
+ * storage (the AESD_BYTE_RING build), so callers keep ownership of any memory they pass in.
+ */
+#ifdef AESD_BYTE_RING
+#define AESD_CIRCULAR_BUFFER_COPIES_ENTRIES 1
+#else
+#define AESD_CIRCULAR_BUFFER_COPIES_ENTRIES 0
+#endif
+
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+const char *aesd_circular_buffer_find_span_for_fpos(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t *span_size_rtn);
+
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+int aesd_circular_buffer_load(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *entries,
+                              size_t count);
+
+int aesd_circular_buffer_reserve(struct aesd_circular_buffer *buffer, size_t size);
+
+void aesd_circular_buffer_free_storage(struct aesd_circular_buffer *buffer);
+
+struct aesd_buffer_entry *aesd_circular_buffer_get_entry(struct aesd_circular_buffer *buffer, uint32_t entry_index);
+
 size_t aesd_circular_buffer_get_num_bytes(struct aesd_circular_buffer* buffer);
 
 long aesd_circular_buffer_calculate_offset(struct aesd_circular_buffer *buffer, 
@@ -66,7 +124,9 @@ long aesd_circular_buffer_calculate_offset(struct aesd_circular_buffer *buffer,
 
 /**
  * Create a for loop to iterate over each member of the circular buffer.
- * Useful when you've allocated memory for circular buffer entries and need to free it
+ * Useful when you've allocated memory for circular buffer entries and need to free it,
+ * skipping entries for which aesd_buffer_entry_is_inline() is true.  Nothing needs freeing
+ * when AESD_CIRCULAR_BUFFER_COPIES_ENTRIES is set.
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
  * @param index is a uint8_t stack allocated value used by this macro for an index
@@ -75,7 +135,8 @@ long aesd_circular_buffer_calculate_offset(struct aesd_circular_buffer *buffer,
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
- *      free(entry->buffptr);
+ *      if (!aesd_buffer_entry_is_inline(entry))
+ *          free(entry->buffptr);
  * }
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
@@ -33,14 +33,69 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * A structure passed by IOCTL describing a user space buffer holding a snapshot of the
+ * aesdchar circular buffer, see AESDCHAR_IOCSNAPSHOT and AESDCHAR_IOCRESTORE
+ */
+struct aesd_snapshot {
+    /**
+     * User space address of the snapshot data
+     */
+    uint64_t data;
+    /**
+     * Size of the buffer at data.  AESDCHAR_IOCSNAPSHOT updates this with the size of the
+     * snapshot, including when it fails with ENOSPC because the buffer is too small.
+     */
+    uint64_t size;
+};
+
+/**
+ * Snapshot data starts with this header, followed by num_entries records, oldest first.
+ * Each record is a uint32_t size followed by size bytes of the write command.
+ * Fields are in host byte order, snapshots are not meant to move between machines.
+ */
+struct aesd_snapshot_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t num_entries;
+};
+
+/**
+ * Returned by AESDCHAR_IOCVERSION, lets user space keep a copy of the device contents and
+ * tell when it went stale.
+ */
+struct aesd_version {
+    /**
+     * Incremented by every write() and restore, whether or not it completed a command
+     */
+    uint64_t generation;
+    /**
+     * Bytes readable from the device
+     */
+    uint64_t size;
+    /**
+     * Bytes written without a newline yet, not readable until a later write completes the command
+     */
+    uint64_t pending;
+};
+
+#define AESD_SNAPSHOT_MAGIC 0x41455344 /* "AESD" */
+#define AESD_SNAPSHOT_VERSION 1
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Dump the circular buffer contents into a user space buffer
+#define AESDCHAR_IOCSNAPSHOT _IOWR(AESD_IOC_MAGIC, 2, struct aesd_snapshot)
+// Replace the circular buffer contents with a snapshot taken by AESDCHAR_IOCSNAPSHOT
+#define AESDCHAR_IOCRESTORE _IOW(AESD_IOC_MAGIC, 3, struct aesd_snapshot)
+// Read the write generation and sizes of the device contents
+#define AESDCHAR_IOCVERSION _IOR(AESD_IOC_MAGIC, 4, struct aesd_version)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 4
 
 #endif /* AESD_IOCTL_H */
@@ -0,0 +1,149 @@
+/**
+ * @file aesdchar-snapshot.c
+ * @brief Saves and restores the contents of an aesdchar device across module reloads
+ *
+ * Usage: aesdchar-snapshot save|restore <device> <file>
+ *
+ * save dumps the device's circular buffer with AESDCHAR_IOCSNAPSHOT and writes it to file,
+ * restore loads file back in a single AESDCHAR_IOCRESTORE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "aesd_ioctl.h"
+
+static int save_snapshot(int device_fd, const char *path)
+{
+    struct aesd_snapshot snapshot = {0};
+    char *data = NULL;
+    FILE *file = NULL;
+    int retval = 1;
+
+    // The first call fails with ENOSPC and reports the required size
+    if (ioctl(device_fd, AESDCHAR_IOCSNAPSHOT, &snapshot) != 0 && errno != ENOSPC)
+    {
+        perror("AESDCHAR_IOCSNAPSHOT failed");
+        goto cleanup;
+    }
+
+    data = malloc(snapshot.size);
+    if (data == NULL)
+    {
+        perror("malloc failed");
+        goto cleanup;
+    }
+
+    snapshot.data = (uintptr_t)data;
+    if (ioctl(device_fd, AESDCHAR_IOCSNAPSHOT, &snapshot) != 0)
+    {
+        perror("AESDCHAR_IOCSNAPSHOT failed");
+        goto cleanup;
+    }
+
+    file = fopen(path, "w");
+    if (file == NULL)
+    {
+        perror("fopen failed");
+        goto cleanup;
+    }
+
+    if (fwrite(data, 1, snapshot.size, file) != snapshot.size || fflush(file) != 0)
+    {
+        perror("fwrite failed");
+        goto cleanup;
+    }
+
+    retval = 0;
+
+cleanup:
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+    free(data);
+    return retval;
+}
+
+static int restore_snapshot(int device_fd, const char *path)
+{
+    struct aesd_snapshot snapshot = {0};
+    struct stat st;
+    char *data = NULL;
+    int fd = -1;
+    int retval = 1;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror("open failed");
+        goto cleanup;
+    }
+
+    data = malloc(st.st_size);
+    if (data == NULL)
+    {
+        perror("malloc failed");
+        goto cleanup;
+    }
+
+    if (read(fd, data, st.st_size) != st.st_size)
+    {
+        perror("read failed");
+        goto cleanup;
+    }
+
+    snapshot.data = (uintptr_t)data;
+    snapshot.size = st.st_size;
+    if (ioctl(device_fd, AESDCHAR_IOCRESTORE, &snapshot) != 0)
+    {
+        perror("AESDCHAR_IOCRESTORE failed");
+        goto cleanup;
+    }
+
+    retval = 0;
+
+cleanup:
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(data);
+    return retval;
+}
+
+int main(int argc, char *argv[])
+{
+    int device_fd;
+    int retval;
+
+    if (argc != 4 || (strcmp(argv[1], "save") != 0 && strcmp(argv[1], "restore") != 0))
+    {
+        fprintf(stderr, "Usage: %s save|restore <device> <file>\n", argv[0]);
+        return 1;
+    }
+
+    device_fd = open(argv[2], O_RDWR);
+    if (device_fd < 0)
+    {
+        perror("open device failed");
+        return 1;
+    }
+
+    if (strcmp(argv[1], "save") == 0)
+    {
+        retval = save_snapshot(device_fd, argv[3]);
+    }
+    else
+    {
+        retval = restore_snapshot(device_fd, argv[3]);
+    }
+
+    close(device_fd);
+    return retval;
+}
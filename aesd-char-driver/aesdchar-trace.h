@@ -0,0 +1,132 @@
+/*
+ * aesdchar-trace.h
+ *
+ * Tracepoints for the aesdchar hot paths.  Enable them at runtime with e.g.
+ *   echo 1 > /sys/kernel/tracing/events/aesdchar/enable
+ * or record them with perf record -e 'aesdchar:*'.  When disabled each
+ * tracepoint is a static branch and the lock wait clock is never read.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(aesd_rw,
+
+    TP_PROTO(size_t count, loff_t f_pos, ssize_t retval, u64 lock_wait_ns),
+
+    TP_ARGS(count, f_pos, retval, lock_wait_ns),
+
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(loff_t, f_pos)
+        __field(ssize_t, retval)
+        __field(u64, lock_wait_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->f_pos = f_pos;
+        __entry->retval = retval;
+        __entry->lock_wait_ns = lock_wait_ns;
+    ),
+
+    TP_printk("count=%zu f_pos=%lld retval=%zd lock_wait_ns=%llu",
+              __entry->count, __entry->f_pos, __entry->retval,
+              __entry->lock_wait_ns)
+);
+
+DEFINE_EVENT(aesd_rw, aesd_read,
+    TP_PROTO(size_t count, loff_t f_pos, ssize_t retval, u64 lock_wait_ns),
+    TP_ARGS(count, f_pos, retval, lock_wait_ns)
+);
+
+DEFINE_EVENT(aesd_rw, aesd_write,
+    TP_PROTO(size_t count, loff_t f_pos, ssize_t retval, u64 lock_wait_ns),
+    TP_ARGS(count, f_pos, retval, lock_wait_ns)
+);
+
+TRACE_EVENT(aesd_flush_pending,
+
+    TP_PROTO(size_t size, u8 in_offs, bool evicted),
+
+    TP_ARGS(size, in_offs, evicted),
+
+    TP_STRUCT__entry(
+        __field(size_t, size)
+        __field(u8, in_offs)
+        __field(bool, evicted)
+    ),
+
+    TP_fast_assign(
+        __entry->size = size;
+        __entry->in_offs = in_offs;
+        __entry->evicted = evicted;
+    ),
+
+    TP_printk("size=%zu in_offs=%u evicted=%d",
+              __entry->size, __entry->in_offs, __entry->evicted)
+);
+
+TRACE_EVENT(aesd_llseek,
+
+    TP_PROTO(loff_t off, int whence, loff_t newpos, u64 lock_wait_ns),
+
+    TP_ARGS(off, whence, newpos, lock_wait_ns),
+
+    TP_STRUCT__entry(
+        __field(loff_t, off)
+        __field(int, whence)
+        __field(loff_t, newpos)
+        __field(u64, lock_wait_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->off = off;
+        __entry->whence = whence;
+        __entry->newpos = newpos;
+        __entry->lock_wait_ns = lock_wait_ns;
+    ),
+
+    TP_printk("off=%lld whence=%d newpos=%lld lock_wait_ns=%llu",
+              __entry->off, __entry->whence, __entry->newpos,
+              __entry->lock_wait_ns)
+);
+
+TRACE_EVENT(aesd_ioctl,
+
+    TP_PROTO(unsigned int cmd, loff_t f_pos, long retval, u64 lock_wait_ns),
+
+    TP_ARGS(cmd, f_pos, retval, lock_wait_ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, cmd)
+        __field(loff_t, f_pos)
+        __field(long, retval)
+        __field(u64, lock_wait_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->cmd = cmd;
+        __entry->f_pos = f_pos;
+        __entry->retval = retval;
+        __entry->lock_wait_ns = lock_wait_ns;
+    ),
+
+    TP_printk("cmd=0x%x f_pos=%lld retval=%ld lock_wait_ns=%llu",
+              __entry->cmd, __entry->f_pos, __entry->retval,
+              __entry->lock_wait_ns)
+);
+
+#endif /* AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_ */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar-trace
+#include <trace/define_trace.h>
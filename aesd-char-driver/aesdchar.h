@@ -31,6 +31,7 @@ struct aesd_dev
     struct aesd_circular_buffer circular_buffer;
     char *pending_buffer;
     size_t pending_buffer_size;
+    u64 generation;       /* bumped by every write and restore, see AESDCHAR_IOCVERSION */
 };
 
 
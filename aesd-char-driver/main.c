@@ -17,9 +17,14 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/slab.h>
+#include <linux/ktime.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 
+#define CREATE_TRACE_POINTS
+#include "aesdchar-trace.h"
+
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
@@ -28,6 +33,28 @@ MODULE_LICENSE("Dual BSD/GPL");
 
 struct aesd_dev aesd_device;
 
+/**
+ * Locks @param device, storing the time spent waiting for the lock in @param lock_wait_ns.
+ * The clock is only read when @param timed is set, which callers tie to their tracepoint
+ * being enabled so the untraced path costs nothing extra.
+ * @return 0 on success, -ERESTARTSYS if interrupted while waiting
+ */
+static int aesd_lock_device(struct aesd_dev *device, bool timed, u64 *lock_wait_ns)
+{
+    u64 start = 0;
+
+    if (timed)
+        start = ktime_get_ns();
+
+    if (mutex_lock_interruptible(&device->lock))
+        return -ERESTARTSYS;
+
+    if (timed)
+        *lock_wait_ns = ktime_get_ns() - start;
+
+    return 0;
+}
+
 static int aesd_open(struct inode *inode, struct file *filp)
 {
     struct aesd_dev *dev;
@@ -50,32 +77,42 @@ static ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff
 {
     ssize_t retval = 0;
     struct aesd_dev *device = filp->private_data;
-    struct aesd_buffer_entry *entry;
-    size_t offset_in_entry = 0;
+    const char *span;
+    size_t span_size = 0;
+    size_t copied = 0;
+    loff_t start_pos = *f_pos;
+    u64 lock_wait_ns = 0;
 
-    if (mutex_lock_interruptible(&device->lock))
+    if (aesd_lock_device(device, trace_aesd_read_enabled(), &lock_wait_ns))
         return -ERESTARTSYS;
 
     PDEBUG("read %zu bytes from offset %lld",count,*f_pos);
     
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&device->circular_buffer, *f_pos, &offset_in_entry);
-    if (entry == NULL)
+    // Copy one contiguous span at a time, entries stored back to back are copied together
+    while (copied < count)
     {
-        goto cleanup;
-    }
+        span = aesd_circular_buffer_find_span_for_fpos(&device->circular_buffer, *f_pos, &span_size);
+        if (span == NULL)
+        {
+            break;
+        }
 
-    count = min(count, entry->size - offset_in_entry);
-    if (copy_to_user(buf, &entry->buffptr[offset_in_entry], count))
-    {
-        retval = -EFAULT;
-        goto cleanup;
+        span_size = min(count - copied, span_size);
+        if (copy_to_user(buf + copied, span, span_size))
+        {
+            retval = -EFAULT;
+            goto cleanup;
+        }
+
+        *f_pos += span_size;
+        copied += span_size;
     }
 
-    *f_pos += count;
-    retval = count;
+    retval = copied;
 
 cleanup:
     mutex_unlock(&device->lock);
+    trace_aesd_read(count, start_pos, retval, lock_wait_ns);
     return retval;
 }
 
@@ -115,46 +152,140 @@ cleanup:
     return retval;
 }
 
-static void flush_pending_buffer(struct aesd_dev *device)
+static int add_circular_buffer_entry(struct aesd_dev *device, const struct aesd_buffer_entry *entry)
 {
-    struct aesd_buffer_entry entry = {0};
+    const char *evicted;
+
+    if (aesd_circular_buffer_reserve(&device->circular_buffer, entry->size) != 0)
+    {
+        return -ENOMEM;
+    }
 
-    PDEBUG("flushing pending_buffer to the circular_buffer[%d]", device->circular_buffer.in_offs);
+    PDEBUG("adding %zu bytes to the circular_buffer[%d]", entry->size, device->circular_buffer.in_offs);
+    trace_aesd_flush_pending(entry->size, device->circular_buffer.in_offs, device->circular_buffer.full);
+
+    evicted = aesd_circular_buffer_add_entry(&device->circular_buffer, entry);
+    if (evicted != NULL)
+    {
+        kfree(evicted);
+    }
+    return 0;
+}
+
+static int flush_pending_buffer(struct aesd_dev *device)
+{
+    struct aesd_buffer_entry entry = {0};
+    int retval;
 
-    entry.buffptr = device->pending_buffer;
     entry.size = device->pending_buffer_size;
-    aesd_circular_buffer_add_entry(&device->circular_buffer, &entry);
+    if (entry.size <= AESD_BUFFER_ENTRY_INLINE_SIZE)
+    {
+        // Small entries live in their ring slot, so the pending allocation isn't kept around
+        memcpy(entry.inline_buffer, device->pending_buffer, entry.size);
+        entry.buffptr = entry.inline_buffer;
+    }
+    else
+    {
+        entry.buffptr = device->pending_buffer;
+    }
+
+    retval = add_circular_buffer_entry(device, &entry);
+    if (retval != 0)
+    {
+        // Keep the pending buffer, the next write retries the flush
+        return retval;
+    }
+
+    if (aesd_buffer_entry_is_inline(&entry))
+    {
+        kfree(device->pending_buffer);
+    }
 
     device->pending_buffer = NULL;
     device->pending_buffer_size = 0;
+    return 0;
+}
+
+/**
+ * Fast path for writes of up to AESD_BUFFER_ENTRY_INLINE_SIZE bytes with nothing pending.
+ * The data is copied straight into an inline entry, so a write completing a command
+ * doesn't allocate at all.
+ */
+static int write_small_entry(struct aesd_dev *device, const char __user *buf, size_t count)
+{
+    struct aesd_buffer_entry entry = {0};
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    if (copy_from_user(entry.inline_buffer, buf, count))
+    {
+        return -EFAULT;
+    }
+
+    if (memchr(entry.inline_buffer, '\n', count) == NULL)
+    {
+        // Not a complete command yet, keep it as the pending buffer
+        device->pending_buffer = kmemdup(entry.inline_buffer, count, GFP_KERNEL);
+        if (device->pending_buffer == NULL)
+        {
+            return -ENOMEM;
+        }
+        device->pending_buffer_size = count;
+        return 0;
+    }
+
+    entry.buffptr = entry.inline_buffer;
+    entry.size = count;
+    return add_circular_buffer_entry(device, &entry);
 }
 
 static ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
 {
     ssize_t retval;
     struct aesd_dev *device = filp->private_data;
+    u64 lock_wait_ns = 0;
     (void) f_pos;
 
-    if (mutex_lock_interruptible(&device->lock))
+    if (aesd_lock_device(device, trace_aesd_write_enabled(), &lock_wait_ns))
         return -ERESTARTSYS;
 
     PDEBUG("write %zu bytes to offset %lld", count, *f_pos);
-    
-    retval = append_to_pending_chunk(device, buf, count);
-    if (retval < 0)
+    device->generation++;
+
+    if (device->pending_buffer == NULL && count <= AESD_BUFFER_ENTRY_INLINE_SIZE)
     {
-        goto cleanup;
+        retval = write_small_entry(device, buf, count);
+        if (retval < 0)
+        {
+            goto cleanup;
+        }
     }
-
-    if (strnchr(device->pending_buffer, device->pending_buffer_size, '\n'))
+    else
     {
-        flush_pending_buffer(device);
+        retval = append_to_pending_chunk(device, buf, count);
+        if (retval < 0)
+        {
+            goto cleanup;
+        }
+
+        if (strnchr(device->pending_buffer, device->pending_buffer_size, '\n'))
+        {
+            retval = flush_pending_buffer(device);
+            if (retval < 0)
+            {
+                goto cleanup;
+            }
+        }
     }
 
     retval = count;
 
 cleanup:
     mutex_unlock(&device->lock);
+    trace_aesd_write(count, *f_pos, retval, lock_wait_ns);
     return retval;
 }
 
@@ -163,8 +294,9 @@ static loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
     loff_t newpos;
     struct aesd_dev *device = filp->private_data;
     size_t num_bytes_in_buffer = 0;
+    u64 lock_wait_ns = 0;
 
-    if (mutex_lock_interruptible(&device->lock))
+    if (aesd_lock_device(device, trace_aesd_llseek_enabled(), &lock_wait_ns))
         return -ERESTARTSYS;
 
     switch(whence) {
@@ -197,6 +329,7 @@ static loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
 
 cleanup:
     mutex_unlock(&device->lock);
+    trace_aesd_llseek(off, whence, newpos, lock_wait_ns);
     return newpos;
 }
 
@@ -220,12 +353,240 @@ static long aesd_seek_to(struct file *filp, struct aesd_dev *device, unsigned lo
     return 0;
 }
 
+static void free_circular_buffer_entries(struct aesd_circular_buffer *circular_buffer)
+{
+    int index = 0;
+    struct aesd_buffer_entry *entry;
+
+    if (AESD_CIRCULAR_BUFFER_COPIES_ENTRIES)
+    {
+        return;
+    }
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, circular_buffer, index)
+    {
+        if (entry->buffptr != NULL && !aesd_buffer_entry_is_inline(entry))
+        {
+            kfree(entry->buffptr);
+        }
+    }
+}
+
+static long aesd_snapshot(struct aesd_dev *device, unsigned long aesd_snapshot_user_address)
+{
+    long retval = 0;
+    struct aesd_snapshot snapshot = {0};
+    struct aesd_snapshot_header header = {0};
+    struct aesd_buffer_entry *entry;
+    char __user *data;
+    size_t required_size = sizeof(header);
+    uint32_t i;
+
+    if (copy_from_user(&snapshot, (const void __user *)aesd_snapshot_user_address, sizeof(snapshot)) != 0)
+    {
+        return -EFAULT;
+    }
+
+    header.magic = AESD_SNAPSHOT_MAGIC;
+    header.version = AESD_SNAPSHOT_VERSION;
+    while ((entry = aesd_circular_buffer_get_entry(&device->circular_buffer, header.num_entries)) != NULL)
+    {
+        required_size += sizeof(uint32_t) + entry->size;
+        header.num_entries++;
+    }
+
+    if (snapshot.size < required_size)
+    {
+        retval = -ENOSPC;
+        goto cleanup;
+    }
+
+    data = u64_to_user_ptr(snapshot.data);
+    if (copy_to_user(data, &header, sizeof(header)))
+    {
+        return -EFAULT;
+    }
+    data += sizeof(header);
+
+    for (i = 0; i < header.num_entries; ++i)
+    {
+        uint32_t size;
+
+        entry = aesd_circular_buffer_get_entry(&device->circular_buffer, i);
+        size = entry->size;
+        if (copy_to_user(data, &size, sizeof(size)) ||
+            copy_to_user(data + sizeof(size), entry->buffptr, size))
+        {
+            return -EFAULT;
+        }
+        data += sizeof(size) + size;
+    }
+
+cleanup:
+    snapshot.size = required_size;
+    if (copy_to_user((void __user *)aesd_snapshot_user_address, &snapshot, sizeof(snapshot)) != 0)
+    {
+        return -EFAULT;
+    }
+    return retval;
+}
+
+/**
+ * Replaces the circular buffer contents with the snapshot described by the struct aesd_snapshot at
+ * @param aesd_snapshot_user_address.  Records which would be evicted anyway are skipped without
+ * being copied, the rest are loaded with a single aesd_circular_buffer_load.
+ */
+static long aesd_restore(struct aesd_dev *device, unsigned long aesd_snapshot_user_address)
+{
+    long retval = 0;
+    struct aesd_snapshot snapshot = {0};
+    struct aesd_snapshot_header header = {0};
+    struct aesd_buffer_entry *entries = NULL;
+    const char __user *data;
+    const char __user *kept_data = NULL;
+    size_t remaining;
+    // Sizes of the records kept, as validated, the user buffer may change under us
+    uint32_t kept_sizes[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t num_to_keep;
+    uint32_t num_kept = 0;
+    uint32_t i;
+
+    if (copy_from_user(&snapshot, (const void __user *)aesd_snapshot_user_address, sizeof(snapshot)) != 0)
+    {
+        return -EFAULT;
+    }
+
+    data = u64_to_user_ptr(snapshot.data);
+    if (snapshot.size < sizeof(header) || copy_from_user(&header, data, sizeof(header)))
+    {
+        return -EINVAL;
+    }
+
+    if (header.magic != AESD_SNAPSHOT_MAGIC || header.version != AESD_SNAPSHOT_VERSION)
+    {
+        return -EINVAL;
+    }
+
+    // Validate every record size first so a truncated snapshot leaves the device untouched
+    data += sizeof(header);
+    remaining = snapshot.size - sizeof(header);
+    num_to_keep = min_t(uint32_t, header.num_entries, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    for (i = 0; i < header.num_entries; ++i)
+    {
+        uint32_t size;
+
+        if (i + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED == header.num_entries)
+        {
+            kept_data = data;
+        }
+
+        if (remaining < sizeof(size) || copy_from_user(&size, data, sizeof(size)))
+        {
+            return -EINVAL;
+        }
+        if (size == 0 || remaining - sizeof(size) < size)
+        {
+            return -EINVAL;
+        }
+        if (i >= header.num_entries - num_to_keep)
+        {
+            kept_sizes[i - (header.num_entries - num_to_keep)] = size;
+        }
+        data += sizeof(size) + size;
+        remaining -= sizeof(size) + size;
+    }
+
+    if (kept_data == NULL)
+    {
+        kept_data = u64_to_user_ptr(snapshot.data) + sizeof(header);
+    }
+
+    entries = kcalloc(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, sizeof(*entries), GFP_KERNEL);
+    if (entries == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    // Only the sizes read by the validation pass are used, not whatever the buffer holds now
+    data = kept_data;
+    for (num_kept = 0; num_kept < num_to_keep; ++num_kept)
+    {
+        uint32_t size = kept_sizes[num_kept];
+        char *buffptr;
+
+        if (size <= AESD_BUFFER_ENTRY_INLINE_SIZE)
+        {
+            buffptr = entries[num_kept].inline_buffer;
+        }
+        else
+        {
+            buffptr = kmalloc(size, GFP_KERNEL | __GFP_NOWARN);
+            if (buffptr == NULL)
+            {
+                retval = -ENOMEM;
+                goto cleanup;
+            }
+        }
+
+        entries[num_kept].buffptr = buffptr;
+        if (copy_from_user(buffptr, data + sizeof(size), size))
+        {
+            if (!aesd_buffer_entry_is_inline(&entries[num_kept]))
+            {
+                kfree(buffptr);
+            }
+            retval = -EFAULT;
+            goto cleanup;
+        }
+
+        entries[num_kept].size = size;
+        data += sizeof(size) + size;
+    }
+
+    PDEBUG("restoring %u of %u snapshot entries", num_kept, header.num_entries);
+
+    device->generation++;
+    free_circular_buffer_entries(&device->circular_buffer);
+    retval = aesd_circular_buffer_load(&device->circular_buffer, entries, num_kept);
+
+cleanup:
+    // On success the circular buffer took over the staged entries, unless it copied them
+    if (retval != 0 || AESD_CIRCULAR_BUFFER_COPIES_ENTRIES)
+    {
+        for (i = 0; i < num_kept; ++i)
+        {
+            if (!aesd_buffer_entry_is_inline(&entries[i]))
+            {
+                kfree(entries[i].buffptr);
+            }
+        }
+    }
+    kfree(entries);
+    return retval;
+}
+
+static long aesd_get_version(struct aesd_dev *device, unsigned long aesd_version_user_address)
+{
+    struct aesd_version version = {0};
+
+    version.generation = device->generation;
+    version.size = aesd_circular_buffer_get_num_bytes(&device->circular_buffer);
+    version.pending = device->pending_buffer_size;
+
+    if (copy_to_user((void __user *)aesd_version_user_address, &version, sizeof(version)) != 0)
+    {
+        return -EFAULT;
+    }
+    return 0;
+}
+
 static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     long retval = 0;
     struct aesd_dev *device = filp->private_data;
+    u64 lock_wait_ns = 0;
 
-    if (mutex_lock_interruptible(&device->lock))
+    if (aesd_lock_device(device, trace_aesd_ioctl_enabled(), &lock_wait_ns))
         return -ERESTARTSYS;
 
     switch (cmd) {
@@ -234,6 +595,18 @@ static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         retval = aesd_seek_to(filp, device, arg);
         break;
 
+    case AESDCHAR_IOCSNAPSHOT:
+        retval = aesd_snapshot(device, arg);
+        break;
+
+    case AESDCHAR_IOCRESTORE:
+        retval = aesd_restore(device, arg);
+        break;
+
+    case AESDCHAR_IOCVERSION:
+        retval = aesd_get_version(device, arg);
+        break;
+
     default:
         retval = -EINVAL;
         goto cleanup;
@@ -241,6 +614,7 @@ static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 cleanup:
     mutex_unlock(&device->lock);
+    trace_aesd_ioctl(cmd, filp->f_pos, retval, lock_wait_ns);
     return retval;
 }
 
@@ -296,21 +670,14 @@ static int aesd_init_module(void)
 
 static void aesd_cleanup_module(void)
 {
-    int index = 0;
-    struct aesd_buffer_entry *entry;
     dev_t devno = MKDEV(aesd_major, aesd_minor);
 
     PDEBUG("aesd module unloading!");
 
     cdev_del(&aesd_device.cdev);
 
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.circular_buffer, index)
-    {
-        if (entry->buffptr != NULL)
-        {
-            kfree(entry->buffptr);
-        }
-    }
+    free_circular_buffer_entries(&aesd_device.circular_buffer);
+    aesd_circular_buffer_free_storage(&aesd_device.circular_buffer);
 
     if (aesd_device.pending_buffer != NULL)
     {
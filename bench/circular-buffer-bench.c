@@ -0,0 +1,230 @@
+/**
+ * @file circular-buffer-bench.c
+ * @brief Userspace microbenchmark for the aesd circular buffer
+ *
+ * Times aesd_circular_buffer_add_entry, aesd_circular_buffer_find_entry_offset_for_fpos,
+ * aesd_circular_buffer_get_num_bytes and aesd_circular_buffer_calculate_offset for a range
+ * of entry sizes, plus a full read of the buffer through aesd_circular_buffer_find_span_for_fpos.
+ * The buffer capacity and storage engine are fixed at compile time, so the CMake project builds
+ * one binary per combination.
+ *
+ * Usage: circular-buffer-bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+#define DEFAULT_ITERATIONS 1000000
+#define MAX_ENTRY_SIZE 4096
+
+static const size_t entry_sizes[] = { 8, 64, 512, MAX_ENTRY_SIZE };
+
+/* Results are accumulated here so the compiler can't drop the calls being timed */
+static volatile size_t sink;
+
+static char payload[MAX_ENTRY_SIZE];
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* xorshift, so the lookups don't walk the buffer in a predictable order */
+static unsigned int next_random(unsigned int *state)
+{
+    unsigned int x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/* Small entries are stored inline, the same way the driver adds them */
+static void make_entry(struct aesd_buffer_entry *entry, size_t entry_size)
+{
+    memset(entry, 0, sizeof(*entry));
+    if (entry_size <= AESD_BUFFER_ENTRY_INLINE_SIZE)
+    {
+        memcpy(entry->inline_buffer, payload, entry_size);
+        entry->buffptr = entry->inline_buffer;
+    }
+    else
+    {
+        entry->buffptr = payload;
+    }
+    entry->size = entry_size;
+}
+
+static void fill_buffer(struct aesd_circular_buffer *buffer, size_t entry_size)
+{
+    struct aesd_buffer_entry entry;
+
+    aesd_circular_buffer_init(buffer);
+    make_entry(&entry, entry_size);
+    for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; ++i)
+    {
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+static double bench_add_entry(size_t entry_size, long iterations)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry;
+    double start;
+    double elapsed;
+
+    fill_buffer(&buffer, entry_size);
+    make_entry(&entry, entry_size);
+
+    start = now_ns();
+    for (long i = 0; i < iterations; ++i)
+    {
+        sink += (size_t)aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    elapsed = now_ns() - start;
+    aesd_circular_buffer_free_storage(&buffer);
+    return elapsed / iterations;
+}
+
+static double bench_find_entry(size_t entry_size, long iterations)
+{
+    struct aesd_circular_buffer buffer;
+    size_t total;
+    size_t offset_in_entry = 0;
+    unsigned int seed = 1;
+    double start;
+    double elapsed;
+
+    fill_buffer(&buffer, entry_size);
+    total = aesd_circular_buffer_get_num_bytes(&buffer);
+
+    start = now_ns();
+    for (long i = 0; i < iterations; ++i)
+    {
+        struct aesd_buffer_entry *entry;
+
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, next_random(&seed) % total,
+                                                                &offset_in_entry);
+        sink += entry->size + offset_in_entry;
+    }
+    elapsed = now_ns() - start;
+    aesd_circular_buffer_free_storage(&buffer);
+    return elapsed / iterations;
+}
+
+/* Walks the whole buffer span by span, the way aesd_read copies it out */
+static double bench_read_spans(size_t entry_size, long iterations)
+{
+    struct aesd_circular_buffer buffer;
+    size_t total;
+    double start;
+    double elapsed;
+
+    fill_buffer(&buffer, entry_size);
+    total = aesd_circular_buffer_get_num_bytes(&buffer);
+
+    start = now_ns();
+    for (long i = 0; i < iterations; ++i)
+    {
+        size_t pos = 0;
+
+        while (pos < total)
+        {
+            size_t span_size = 0;
+
+            sink += (size_t)aesd_circular_buffer_find_span_for_fpos(&buffer, pos, &span_size);
+            pos += span_size;
+        }
+    }
+    elapsed = now_ns() - start;
+    aesd_circular_buffer_free_storage(&buffer);
+    return elapsed / iterations;
+}
+
+static double bench_get_num_bytes(size_t entry_size, long iterations)
+{
+    struct aesd_circular_buffer buffer;
+    double start;
+    double elapsed;
+
+    fill_buffer(&buffer, entry_size);
+
+    start = now_ns();
+    for (long i = 0; i < iterations; ++i)
+    {
+        sink += aesd_circular_buffer_get_num_bytes(&buffer);
+    }
+    elapsed = now_ns() - start;
+    aesd_circular_buffer_free_storage(&buffer);
+    return elapsed / iterations;
+}
+
+static double bench_calculate_offset(size_t entry_size, long iterations)
+{
+    struct aesd_circular_buffer buffer;
+    unsigned int seed = 1;
+    double start;
+    double elapsed;
+
+    fill_buffer(&buffer, entry_size);
+
+    start = now_ns();
+    for (long i = 0; i < iterations; ++i)
+    {
+        unsigned int r = next_random(&seed);
+
+        sink += aesd_circular_buffer_calculate_offset(&buffer, r % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+                                                      (r >> 8) % entry_size);
+    }
+    elapsed = now_ns() - start;
+    aesd_circular_buffer_free_storage(&buffer);
+    return elapsed / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = DEFAULT_ITERATIONS;
+
+    if (argc > 1)
+    {
+        iterations = strtol(argv[1], NULL, 10);
+        if (iterations <= 0)
+        {
+            fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    memset(payload, 'a', sizeof(payload));
+
+#ifdef AESD_BYTE_RING
+    printf("capacity=%d storage=byte-ring iterations=%ld (ns/op)\n", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, iterations);
+#else
+    printf("capacity=%d storage=entries iterations=%ld (ns/op)\n", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, iterations);
+#endif
+    printf("%10s %12s %12s %12s %14s %18s\n", "entry_size", "add_entry", "find_entry", "read_spans",
+           "get_num_bytes", "calculate_offset");
+    for (size_t i = 0; i < sizeof(entry_sizes) / sizeof(entry_sizes[0]); ++i)
+    {
+        size_t entry_size = entry_sizes[i];
+
+        printf("%10zu %12.1f %12.1f %12.1f %14.1f %18.1f\n", entry_size,
+               bench_add_entry(entry_size, iterations),
+               bench_find_entry(entry_size, iterations),
+               bench_read_spans(entry_size, iterations),
+               bench_get_num_bytes(entry_size, iterations),
+               bench_calculate_offset(entry_size, iterations));
+    }
+
+    return 0;
+}
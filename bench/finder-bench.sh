@@ -0,0 +1,105 @@
+#!/bin/sh
+# Compares the native finder's search kernels against GNU grep counting matching lines, on a
+# generated corpus of text files that is read once beforehand so every run hits the page cache.
+#
+# Usage: finder-bench.sh FINDER [files] [lines_per_file] [runs]
+#   FINDER is the finder binary built by finder-app/Makefile.  Kernels the CPU lacks fall back
+#   to sse2 or scalar, see finder-match.h, so each row is labelled with the kernel finder reports
+#   it ran.
+
+set -e
+set -u
+
+if [ $# -lt 1 ] || [ ! -x "$1" ]; then
+	echo "Usage: $0 FINDER [files] [lines_per_file] [runs]"
+	exit 1
+fi
+
+FINDER=$1
+FILES=${2:-2000}
+LINES=${3:-2000}
+RUNS=${4:-5}
+PATTERN=AELD_IS_FUN
+CORPUS=$(mktemp -d)
+EMPTY=$(mktemp -d)
+trap 'rm -rf "$CORPUS" "$EMPTY"' EXIT
+
+# Lines of random words over a small alphabet, so the first and last bytes of the pattern show
+# up often, and one line in 50 containing the pattern
+echo "Generating ${FILES} files of ${LINES} lines in ${CORPUS}"
+awk -v files="$FILES" -v lines="$LINES" -v dir="$CORPUS" -v pattern="$PATTERN" 'BEGIN {
+	srand(1)
+	alphabet = "AEFILNSUD_ abcdefghij"
+	for (f = 0; f < files; f++) {
+		path = sprintf("%s/d%d/file%d.txt", dir, f % 16, f)
+		if (f < 16) {
+			system("mkdir -p " dir "/d" f)
+		}
+		for (l = 0; l < lines; l++) {
+			line = ""
+			words = int(rand() * 12) + 4
+			for (w = 0; w < words; w++) {
+				length_ = int(rand() * 9) + 2
+				word = ""
+				for (c = 0; c < length_; c++) {
+					word = word substr(alphabet, int(rand() * length(alphabet)) + 1, 1)
+				}
+				line = line word " "
+			}
+			if (rand() < 0.02) {
+				line = line pattern
+			}
+			print line > path
+		}
+		close(path)
+	}
+}'
+cat "$CORPUS"/*/* > /dev/null
+
+now_ms() {
+	echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# Prints the best of RUNS wall clock times of the given command, in ms, and its output
+best_of() {
+	best=
+	for run in $(seq 1 "$RUNS"); do
+		start=$(now_ms)
+		output=$("$@")
+		elapsed=$(( $(now_ms) - start ))
+		if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+			best=$elapsed
+		fi
+	done
+	printf '%8s ms  %s\n' "$best" "$output"
+}
+
+grep_count() {
+	grep -r "$PATTERN" "$CORPUS" | wc -l
+}
+
+finder_count() {
+	FINDER_MATCH=$1 "$FINDER" "$CORPUS" "$PATTERN" 2>/dev/null
+}
+
+# The kernel finder really runs when asked for $1, which is another one if the CPU lacks it
+finder_kernel() {
+	FINDER_MATCH=$1 "$FINDER" "$EMPTY" "$PATTERN" 2>&1 >/dev/null |
+		sed -n 's/^finder: using the \(.*\) search kernel$/\1/p'
+}
+
+printf '%-12s' "grep"
+best_of grep_count
+measured=
+for engine in scalar sse2 avx2; do
+	kernel=$(finder_kernel "$engine")
+	case " $measured " in
+	*" $kernel "*)
+		printf '%-12s%s\n' "$engine" "not supported by this CPU, runs $kernel"
+		continue
+		;;
+	esac
+	measured="$measured $kernel"
+	printf '%-12s' "$kernel"
+	best_of finder_count "$engine"
+done
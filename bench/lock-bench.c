@@ -0,0 +1,424 @@
+/**
+ * @file lock-bench.c
+ * @brief Contention between threads taking one lock, across lock implementations
+ *
+ * Every thread runs the loop of threadfunc in examples/threading: take the lock, hold it for a
+ * while, release it, then work outside of it for a while before the next round.  The hold time
+ * is swept to cover anything from a counter update to the file append aesdsocket does under its
+ * data file mutex, and the threads spin instead of sleeping so the lock, not the scheduler, is
+ * what gets measured.
+ *
+ * For every lock, thread count and hold time it reports the throughput, Jain's fairness index
+ * over the acquisitions per thread (1.0 when every thread got the lock equally often, 1/threads
+ * when a single one got it every time) and percentiles of the time from asking for the lock to
+ * getting it.  The two clock reads around every acquisition are included in that latency.
+ *
+ * Usage: lock-bench [duration_ms] [max_threads]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define DEFAULT_DURATION_MS 200
+#define THINK_NS 500
+#define CACHE_LINE_SIZE 64
+
+/* Latencies below 16 ns get a bucket each, larger ones 16 buckets per power of two */
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS 1024
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+static const long hold_times_ns[] = { 0, 100, 1000, 10000 };
+
+struct ticket_lock
+{
+    uint32_t next;
+    uint32_t serving;
+};
+
+union bench_lock
+{
+    pthread_mutex_t mutex;
+    pthread_spinlock_t spinlock;
+    struct ticket_lock ticket;
+    // 0 unlocked, 1 locked, 2 locked with waiters
+    uint32_t futex;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct lock_ops
+{
+    const char *name;
+    void (*init)(union bench_lock *lock);
+    void (*lock)(union bench_lock *lock);
+    void (*unlock)(union bench_lock *lock);
+    void (*destroy)(union bench_lock *lock);
+};
+
+struct worker
+{
+    pthread_t thread;
+    uint64_t acquisitions;
+    // When this worker started and stopped acquiring, the run spans the earliest to the latest
+    double started;
+    double finished;
+    uint64_t latency_buckets[LATENCY_BUCKETS];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static union bench_lock bench_lock;
+static const struct lock_ops *current_ops;
+static long current_hold_ns;
+static pthread_barrier_t start_barrier;
+static int stop;
+
+/* Shared state the critical section writes to, so the lock protects something */
+static volatile uint64_t protected_counter;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void spin_for(long ns)
+{
+    double deadline;
+
+    if (ns <= 0)
+    {
+        return;
+    }
+    deadline = now_ns() + ns;
+    while (now_ns() < deadline)
+    {
+        cpu_relax();
+    }
+}
+
+static void mutex_init(union bench_lock *lock)
+{
+    pthread_mutex_init(&lock->mutex, NULL);
+}
+
+static void adaptive_mutex_init(union bench_lock *lock)
+{
+    pthread_mutexattr_t attr;
+
+    // Spins for a bounded number of rounds before sleeping in the kernel
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+    pthread_mutex_init(&lock->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void mutex_lock(union bench_lock *lock)
+{
+    pthread_mutex_lock(&lock->mutex);
+}
+
+static void mutex_unlock(union bench_lock *lock)
+{
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+static void mutex_destroy(union bench_lock *lock)
+{
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+static void spinlock_init(union bench_lock *lock)
+{
+    pthread_spin_init(&lock->spinlock, PTHREAD_PROCESS_PRIVATE);
+}
+
+static void spinlock_lock(union bench_lock *lock)
+{
+    pthread_spin_lock(&lock->spinlock);
+}
+
+static void spinlock_unlock(union bench_lock *lock)
+{
+    pthread_spin_unlock(&lock->spinlock);
+}
+
+static void spinlock_destroy(union bench_lock *lock)
+{
+    pthread_spin_destroy(&lock->spinlock);
+}
+
+static void ticket_init(union bench_lock *lock)
+{
+    lock->ticket.next = 0;
+    lock->ticket.serving = 0;
+}
+
+/* Threads get the lock in the order they asked for it */
+static void ticket_lock(union bench_lock *lock)
+{
+    uint32_t ticket = __atomic_fetch_add(&lock->ticket.next, 1, __ATOMIC_RELAXED);
+
+    while (__atomic_load_n(&lock->ticket.serving, __ATOMIC_ACQUIRE) != ticket)
+    {
+        cpu_relax();
+    }
+}
+
+static void ticket_unlock(union bench_lock *lock)
+{
+    // Only the holder writes serving
+    __atomic_store_n(&lock->ticket.serving, lock->ticket.serving + 1, __ATOMIC_RELEASE);
+}
+
+static void no_destroy(union bench_lock *lock)
+{
+    (void)lock;
+}
+
+static void futex_init(union bench_lock *lock)
+{
+    lock->futex = 0;
+}
+
+/* The three state mutex from Ulrich Drepper's "Futexes Are Tricky" */
+static void futex_lock(union bench_lock *lock)
+{
+    uint32_t state = 0;
+
+    if (__atomic_compare_exchange_n(&lock->futex, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    if (state != 2)
+    {
+        state = __atomic_exchange_n(&lock->futex, 2, __ATOMIC_ACQUIRE);
+    }
+    while (state != 0)
+    {
+        syscall(SYS_futex, &lock->futex, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+        state = __atomic_exchange_n(&lock->futex, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void futex_unlock(union bench_lock *lock)
+{
+    // Only enter the kernel if somebody may be waiting
+    if (__atomic_exchange_n(&lock->futex, 0, __ATOMIC_RELEASE) == 2)
+    {
+        syscall(SYS_futex, &lock->futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+static const struct lock_ops lock_ops[] =
+{
+    { "mutex", mutex_init, mutex_lock, mutex_unlock, mutex_destroy },
+    { "adaptive", adaptive_mutex_init, mutex_lock, mutex_unlock, mutex_destroy },
+    { "spinlock", spinlock_init, spinlock_lock, spinlock_unlock, spinlock_destroy },
+    { "ticket", ticket_init, ticket_lock, ticket_unlock, no_destroy },
+    { "futex", futex_init, futex_lock, futex_unlock, no_destroy },
+};
+
+static unsigned latency_bucket(uint64_t ns)
+{
+    unsigned exponent;
+    unsigned bucket;
+
+    if (ns < LATENCY_SUB_BUCKETS)
+    {
+        return ns;
+    }
+    exponent = 63 - __builtin_clzll(ns);
+    bucket = (exponent - 3) * LATENCY_SUB_BUCKETS + ((ns >> (exponent - 4)) & (LATENCY_SUB_BUCKETS - 1));
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/* Lower bound of the latencies counted in @param bucket */
+static uint64_t latency_bucket_ns(unsigned bucket)
+{
+    unsigned exponent;
+
+    if (bucket < LATENCY_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    exponent = bucket / LATENCY_SUB_BUCKETS + 3;
+    return (1ULL << exponent) | ((uint64_t)(bucket % LATENCY_SUB_BUCKETS) << (exponent - 4));
+}
+
+static uint64_t latency_percentile(const uint64_t *buckets, uint64_t total, double percentile)
+{
+    uint64_t rank = (uint64_t)(total * percentile / 100.0);
+    uint64_t seen = 0;
+
+    for (unsigned bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+    {
+        seen += buckets[bucket];
+        if (seen > rank)
+        {
+            return latency_bucket_ns(bucket);
+        }
+    }
+    return latency_bucket_ns(LATENCY_BUCKETS - 1);
+}
+
+static void *worker_func(void *arg)
+{
+    struct worker *worker = (struct worker *)arg;
+    const struct lock_ops *ops = current_ops;
+    long hold_ns = current_hold_ns;
+
+    pthread_barrier_wait(&start_barrier);
+    worker->started = now_ns();
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        double requested = now_ns();
+        double acquired;
+
+        ops->lock(&bench_lock);
+        acquired = now_ns();
+        protected_counter++;
+        spin_for(hold_ns);
+        ops->unlock(&bench_lock);
+
+        worker->acquisitions++;
+        worker->latency_buckets[latency_bucket((uint64_t)(acquired - requested))]++;
+        spin_for(THINK_NS);
+    }
+    worker->finished = now_ns();
+    return NULL;
+}
+
+static void run(const struct lock_ops *ops, int threads, long hold_ns, long duration_ms)
+{
+    struct worker *workers = aligned_alloc(CACHE_LINE_SIZE, threads * sizeof(struct worker));
+    uint64_t *buckets = calloc(LATENCY_BUCKETS, sizeof(uint64_t));
+    struct timespec duration = { duration_ms / 1000, (duration_ms % 1000) * 1000000L };
+    uint64_t total = 0;
+    double sum_squares = 0;
+    double start = 0;
+    double end = 0;
+    double elapsed;
+
+    if (workers == NULL || buckets == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memset(workers, 0, threads * sizeof(struct worker));
+
+    current_ops = ops;
+    current_hold_ns = hold_ns;
+    ops->init(&bench_lock);
+    __atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+    pthread_barrier_init(&start_barrier, NULL, threads + 1);
+    for (int i = 0; i < threads; ++i)
+    {
+        if (pthread_create(&workers[i].thread, NULL, worker_func, &workers[i]) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    nanosleep(&duration, NULL);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < threads; ++i)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    pthread_barrier_destroy(&start_barrier);
+    ops->destroy(&bench_lock);
+
+    /*
+     * Timed from the workers' own clocks rather than around the barrier in this thread, which
+     * may only get to run after they already started acquiring
+     */
+    for (int i = 0; i < threads; ++i)
+    {
+        if (i == 0 || workers[i].started < start)
+        {
+            start = workers[i].started;
+        }
+        if (workers[i].finished > end)
+        {
+            end = workers[i].finished;
+        }
+        total += workers[i].acquisitions;
+        sum_squares += (double)workers[i].acquisitions * workers[i].acquisitions;
+        for (unsigned bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+        {
+            buckets[bucket] += workers[i].latency_buckets[bucket];
+        }
+    }
+    elapsed = end - start;
+
+    printf("%-10s %8d %8ld %10.3f %9.3f %10llu %10llu %10llu\n", ops->name, threads, hold_ns,
+           total / elapsed * 1e3, sum_squares > 0 ? (double)total * total / (threads * sum_squares) : 0,
+           (unsigned long long)latency_percentile(buckets, total, 50),
+           (unsigned long long)latency_percentile(buckets, total, 99),
+           (unsigned long long)latency_percentile(buckets, total, 99.9));
+
+    free(buckets);
+    free(workers);
+}
+
+int main(int argc, char *argv[])
+{
+    long duration_ms = DEFAULT_DURATION_MS;
+    long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (argc > 1)
+    {
+        duration_ms = strtol(argv[1], NULL, 10);
+    }
+    if (argc > 2)
+    {
+        max_threads = strtol(argv[2], NULL, 10);
+    }
+    if (duration_ms <= 0 || max_threads <= 0)
+    {
+        fprintf(stderr, "Usage: %s [duration_ms] [max_threads]\n", argv[0]);
+        return 1;
+    }
+
+    printf("duration=%ldms think=%dns (latencies in ns)\n", duration_ms, THINK_NS);
+    printf("%-10s %8s %8s %10s %9s %10s %10s %10s\n",
+           "lock", "threads", "hold_ns", "Mops/s", "fairness", "p50", "p99", "p99.9");
+    for (size_t i = 0; i < sizeof(lock_ops) / sizeof(lock_ops[0]); ++i)
+    {
+        for (size_t j = 0; j < sizeof(hold_times_ns) / sizeof(hold_times_ns[0]); ++j)
+        {
+            // 1, 2, 4, ... and max_threads itself when it isn't a power of two
+            long threads = 1;
+
+            while (1)
+            {
+                run(&lock_ops[i], threads, hold_times_ns[j], duration_ms);
+                if (threads == max_threads)
+                {
+                    break;
+                }
+                threads = threads * 2 < max_threads ? threads * 2 : max_threads;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,145 @@
+/**
+ * @file spawn-bench.c
+ * @brief Launch latency of do_exec against the size of the calling process
+ *
+ * Grows the resident set of the benchmark step by step and, at every size, times launching
+ * /bin/true through a plain fork()/execv()/waitpid() and through do_exec(), which uses
+ * posix_spawn().  fork() copies the parent's page tables, so its cost grows with the RSS,
+ * while posix_spawn() shares the address space until the child execs.
+ *
+ * Usage: spawn-bench [iterations] [max_rss_mib]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "systemcalls.h"
+
+#define DEFAULT_ITERATIONS 200
+#define DEFAULT_MAX_RSS_MIB 1024
+#define COMMAND "/bin/true"
+
+static const size_t rss_steps_mib[] = { 0, 16, 64, 256, 1024, 4096 };
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The reference do_exec used to be: a full fork() followed by execv() in the child */
+static int fork_exec(void)
+{
+    char *command[] = { COMMAND, NULL };
+    int status;
+    pid_t pid = fork();
+
+    if (pid < 0)
+    {
+        return -1;
+    }
+    if (pid == 0)
+    {
+        execv(command[0], command);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static double bench_fork_exec(long iterations)
+{
+    double start = now_ns();
+
+    for (long i = 0; i < iterations; ++i)
+    {
+        if (fork_exec() != 0)
+        {
+            fprintf(stderr, "fork/execv of %s failed\n", COMMAND);
+            exit(1);
+        }
+    }
+    return (now_ns() - start) / iterations / 1000;
+}
+
+static double bench_do_exec(long iterations)
+{
+    double start = now_ns();
+
+    for (long i = 0; i < iterations; ++i)
+    {
+        if (!do_exec(1, COMMAND))
+        {
+            fprintf(stderr, "do_exec of %s failed\n", COMMAND);
+            exit(1);
+        }
+    }
+    return (now_ns() - start) / iterations / 1000;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = DEFAULT_ITERATIONS;
+    long max_rss_mib = DEFAULT_MAX_RSS_MIB;
+    char *ballast = NULL;
+    size_t ballast_size = 0;
+
+    if (argc > 1)
+    {
+        iterations = strtol(argv[1], NULL, 10);
+    }
+    if (argc > 2)
+    {
+        max_rss_mib = strtol(argv[2], NULL, 10);
+    }
+    if (iterations <= 0 || max_rss_mib < 0)
+    {
+        fprintf(stderr, "Usage: %s [iterations] [max_rss_mib]\n", argv[0]);
+        return 1;
+    }
+
+    printf("command=%s iterations=%ld (us/launch)\n", COMMAND, iterations);
+    printf("%12s %12s %12s %10s\n", "rss_mib", "fork_execv", "do_exec", "speedup");
+    for (size_t i = 0; i < sizeof(rss_steps_mib) / sizeof(rss_steps_mib[0]); ++i)
+    {
+        size_t size = rss_steps_mib[i] * 1024 * 1024;
+        double fork_us;
+        double spawn_us;
+
+        if (rss_steps_mib[i] > (size_t)max_rss_mib)
+        {
+            break;
+        }
+
+        // Touch every page of the ballast so it's resident and mapped in the page tables
+        if (size > ballast_size)
+        {
+            char *grown = realloc(ballast, size);
+
+            if (grown == NULL)
+            {
+                fprintf(stderr, "Couldn't grow the RSS to %zu MiB\n", rss_steps_mib[i]);
+                break;
+            }
+            ballast = grown;
+            memset(ballast + ballast_size, 1, size - ballast_size);
+            ballast_size = size;
+        }
+
+        fork_us = bench_fork_exec(iterations);
+        spawn_us = bench_do_exec(iterations);
+        printf("%12zu %12.1f %12.1f %9.1fx\n", rss_steps_mib[i], fork_us, spawn_us, fork_us / spawn_us);
+    }
+
+    free(ballast);
+    return 0;
+}
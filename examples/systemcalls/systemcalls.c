@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 #include <unistd.h>
 #include <sys/types.h>
@@ -6,6 +7,87 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+// Completions handled per epoll_wait() in do_exec_batch()
+#define EXEC_BATCH_MAX_EVENTS 32
+// First allocation for output captured by do_exec_capture(), doubled as needed
+#define CAPTURE_INITIAL_CAPACITY 4096
+#define CAPTURE_READ_SIZE 65536
+
+// Anything that makes the shell do more than split a command on blanks
+#define SHELL_METACHARACTERS "|&;<>()$`\\\"'*?[]#~=!{}\n\r"
+#define BLANKS " \t"
+
+extern char **environ;
+
+// Words the shell treats specially in command position, even without metacharacters
+static const char *const shell_reserved_words[] =
+{
+    "if", "then", "else", "elif", "fi", "case", "esac", "for", "while", "until",
+    "do", "done", "in", "function", "select", "time",
+};
+
+/**
+ * Splits @param cmd into words if it's a simple command the shell would only split on blanks:
+ * no quoting, expansions, redirections, globs, variable assignments or reserved words.
+ * @param words set to the copy of @param cmd the words point into, free it along with the result
+ * @return a NULL terminated argv, or NULL if @param cmd needs the shell
+ */
+static char **split_simple_command(const char *cmd, char **words)
+{
+    size_t max_words = strlen(cmd) / 2 + 2;
+    char **argv;
+    char *saveptr;
+    size_t count = 0;
+
+    *words = NULL;
+    if (cmd[strcspn(cmd, SHELL_METACHARACTERS)] != '\0')
+    {
+        return NULL;
+    }
+
+    *words = strdup(cmd);
+    argv = malloc(max_words * sizeof(*argv));
+    if (*words == NULL || argv == NULL)
+    {
+        free(*words);
+        *words = NULL;
+        free(argv);
+        return NULL;
+    }
+
+    for (char *word = strtok_r(*words, BLANKS, &saveptr); word != NULL; word = strtok_r(NULL, BLANKS, &saveptr))
+    {
+        argv[count++] = word;
+    }
+    argv[count] = NULL;
+
+    if (count == 0)
+    {
+        goto shell;
+    }
+    for (size_t i = 0; i < sizeof(shell_reserved_words) / sizeof(shell_reserved_words[0]); ++i)
+    {
+        if (strcmp(argv[0], shell_reserved_words[i]) == 0)
+        {
+            goto shell;
+        }
+    }
+    return argv;
+
+shell:
+    free(argv);
+    free(*words);
+    *words = NULL;
+    return NULL;
+}
 
 /**
  * @param cmd the command to execute with system()
@@ -28,6 +110,36 @@ bool do_system(const char *cmd)
         return false;
     }
 
+    /*
+     * system() runs every command through /bin/sh, two process launches per command.  Simple
+     * commands are split here and started directly instead, searching PATH like the shell.
+     * Anything else goes to the shell, and so does a command that can't be spawned: it may be
+     * a builtin like cd or exit, or the shell reports the error the way callers expect.
+     */
+    char *words;
+    char **argv = split_simple_command(cmd, &words);
+    if (argv != NULL)
+    {
+        pid_t pid;
+        int status = -1;
+        int error = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+
+        free(argv);
+        free(words);
+        if (error == 0)
+        {
+            while (waitpid(pid, &status, 0) < 0)
+            {
+                if (errno != EINTR)
+                {
+                    perror("waitpid failed");
+                    return false;
+                }
+            }
+            return status == 0;
+        }
+    }
+
     int retval = system(cmd);
     if (retval != 0)
     {
@@ -37,6 +149,75 @@ bool do_system(const char *cmd)
     return true;
 }
 
+/**
+ * Starts command[0] with the arguments in @param command.
+ * posix_spawn() starts the child with vfork semantics (clone(CLONE_VM|CLONE_VFORK) in glibc)
+ * rather than a full fork(), so the cost doesn't grow with the caller's page tables, which
+ * dominates launching a command from a process with a large RSS.
+ * @param file_actions applied in the child before the exec, may be NULL
+ * @return the pid of the child, or -1 if it couldn't be started
+ */
+static pid_t spawn_command(char *const command[], const posix_spawn_file_actions_t *file_actions)
+{
+    pid_t pid;
+    int error;
+
+    // Failures of the file actions or the exec itself are reported here rather than by the child
+    error = posix_spawn(&pid, command[0], file_actions, NULL, command, environ);
+    if (error != 0)
+    {
+        fprintf(stderr, "posix_spawn %s failed: %s\n", command[0], strerror(error));
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * Waits for the command started as @param pid to exit
+ * @return true if it exited with 0
+ */
+static bool wait_command(pid_t pid)
+{
+    int status;
+
+    if (waitpid(pid, &status, 0) < 0)
+    {
+        perror("waitpid failed");
+        return false;
+    }
+
+    if (!WIFEXITED(status))
+    {
+        printf("Child didn't exited normally\n");
+        return false;
+    }
+
+    int command_retval = WEXITSTATUS(status);
+    if (command_retval != 0)
+    {
+        printf("Command returned with %d\n", command_retval);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Runs command[0] with the arguments in @param command and waits for it to exit.
+ * @param file_actions applied in the child before the exec, may be NULL
+ * @return true if the command ran and exited with 0
+ */
+static bool spawn_and_wait(char *command[], const posix_spawn_file_actions_t *file_actions)
+{
+    pid_t pid = spawn_command(command, file_actions);
+
+    if (pid < 0)
+    {
+        return false;
+    }
+    return wait_command(pid);
+}
+
 /**
 * @param count -The numbers of variables passed to the function. The variables are command to execute.
 *   followed by arguments to pass to the command
@@ -72,50 +253,8 @@ bool do_exec(int count, ...)
  *   as second argument to the execv() command.
  *
 */
-    bool retval = true;
-
-    int pid = fork();
-    if (pid < 0)
-    {
-        perror("fork failed");
-        retval = false;
-        goto cleanup;
-    }
-
-    if (pid == 0)
-    {
-        // Child
-        execv(command[0], command);
-
-        perror("execv failed");
-        _exit(-1);
-    }
+    bool retval = spawn_and_wait(command, NULL);
 
-    // Parent
-    int status;
-    if (waitpid(pid, &status, 0) < 0)
-    {
-        perror("waitpid failed");
-        retval = false;
-        goto cleanup;
-    }
-
-    if (!WIFEXITED(status))
-    {
-        printf("Child didn't exited normally\n");
-        retval = false;
-        goto cleanup;
-    }
-
-    int command_retval = WEXITSTATUS(status);
-    if (command_retval != 0)
-    {
-        printf("Command returned with %d\n", command_retval);
-        retval = false;
-        goto cleanup;
-    }
-
-cleanup:
     va_end(args);
     return retval;
 }
@@ -149,66 +288,462 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
  *
 */
 
-    bool retval = true;
-    int fd = -1;
+    bool retval = false;
+    posix_spawn_file_actions_t file_actions;
+    int error;
 
-    fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
-    if (fd < 0)
+    error = posix_spawn_file_actions_init(&file_actions);
+    if (error != 0)
     {
-        perror("open failed");
-        retval = false;
+        fprintf(stderr, "posix_spawn_file_actions_init failed: %s\n", strerror(error));
         goto cleanup;
     }
 
-    int pid = fork();
+    // Opened in the child as its stdout, so the parent never holds the file open
+    error = posix_spawn_file_actions_addopen(&file_actions, 1, outputfile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
+    if (error != 0)
+    {
+        fprintf(stderr, "posix_spawn_file_actions_addopen failed: %s\n", strerror(error));
+        goto destroy;
+    }
+
+    retval = spawn_and_wait(command, &file_actions);
+
+destroy:
+    posix_spawn_file_actions_destroy(&file_actions);
+cleanup:
+    va_end(args);
+    return retval;
+}
+
+/**
+ * Makes room in @param capture for @param wanted more bytes and a terminating NUL, as far as
+ * its limit and a caller supplied buffer allow
+ * @return the number of bytes there is room for, which may be less than @param wanted
+ */
+static size_t capture_reserve(struct exec_capture *capture, bool growable, size_t wanted)
+{
+    size_t room;
+
+    if (capture->limit != 0 && capture->length + wanted > capture->limit)
+    {
+        wanted = capture->limit - capture->length;
+    }
+
+    if (growable && capture->length + wanted + 1 > capture->capacity)
+    {
+        size_t capacity = capture->capacity ? capture->capacity : CAPTURE_INITIAL_CAPACITY;
+        char *buffer;
+
+        while (capacity < capture->length + wanted + 1)
+        {
+            capacity *= 2;
+        }
+        buffer = realloc(capture->buffer, capacity);
+        if (buffer == NULL)
+        {
+            perror("realloc failed");
+        }
+        else
+        {
+            capture->buffer = buffer;
+            capture->capacity = capacity;
+        }
+    }
+
+    room = capture->capacity > capture->length + 1 ? capture->capacity - capture->length - 1 : 0;
+    return room < wanted ? room : wanted;
+}
+
+/**
+ * Reads what's available on @param fd into @param capture, discarding what doesn't fit
+ * @return the number of bytes read, 0 at end of file, -1 on error
+ */
+static ssize_t capture_read(int fd, struct exec_capture *capture, bool growable)
+{
+    char discard[CAPTURE_READ_SIZE];
+    size_t room = capture_reserve(capture, growable, CAPTURE_READ_SIZE);
+    ssize_t bytes_read;
+
+    if (room > 0)
+    {
+        bytes_read = read(fd, capture->buffer + capture->length, room);
+        if (bytes_read > 0)
+        {
+            capture->length += bytes_read;
+            capture->buffer[capture->length] = '\0';
+        }
+        return bytes_read;
+    }
+
+    // Keep draining so the command never blocks on a full pipe
+    bytes_read = read(fd, discard, sizeof(discard));
+    if (bytes_read > 0)
+    {
+        capture->truncated = true;
+    }
+    return bytes_read;
+}
+
+/**
+* @param out - Where to capture the command's stdout, NULL to leave it alone
+* @param err - Where to capture the command's stderr, NULL to leave it alone
+* All other parameters, see do_exec above
+* @return true if the command ran and exited with 0.  The output captured up to then is kept
+*   either way.
+*/
+bool do_exec_capture(struct exec_capture *out, struct exec_capture *err, int count, ...)
+{
+/*
+ * The command writes into pipes which are drained with poll() while it runs, so its output
+ * never touches the disk.  Both streams are drained together, a command filling one pipe while
+ * the other is only read afterwards would otherwise deadlock.
+ */
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+
+    struct exec_capture *captures[2] = { out, err };
+    bool growable[2];
+    int pipes[2][2] = { { -1, -1 }, { -1, -1 } };
+    struct pollfd fds[2];
+    posix_spawn_file_actions_t file_actions;
+    bool retval = false;
+    int error;
+    int open_pipes = 0;
+    pid_t pid;
+
+    error = posix_spawn_file_actions_init(&file_actions);
+    if (error != 0)
+    {
+        fprintf(stderr, "posix_spawn_file_actions_init failed: %s\n", strerror(error));
+        va_end(args);
+        return false;
+    }
+
+    for (i = 0; i < 2; ++i)
+    {
+        if (captures[i] == NULL)
+        {
+            continue;
+        }
+
+        growable[i] = captures[i]->buffer == NULL;
+        if (growable[i])
+        {
+            captures[i]->capacity = 0;
+        }
+        captures[i]->length = 0;
+        captures[i]->truncated = false;
+        if (captures[i]->capacity > 0)
+        {
+            captures[i]->buffer[0] = '\0';
+        }
+
+        if (pipe2(pipes[i], O_CLOEXEC) < 0)
+        {
+            perror("pipe2 failed");
+            goto cleanup;
+        }
+        // dup2() clears O_CLOEXEC on stdout/stderr, the pipe ends themselves close on exec
+        error = posix_spawn_file_actions_adddup2(&file_actions, pipes[i][1], i + 1);
+        if (error != 0)
+        {
+            fprintf(stderr, "posix_spawn_file_actions_adddup2 failed: %s\n", strerror(error));
+            goto cleanup;
+        }
+    }
+
+    pid = spawn_command(command, &file_actions);
     if (pid < 0)
     {
-        perror("fork failed");
-        retval = false;
         goto cleanup;
     }
 
-    if (pid == 0)
+    for (i = 0; i < 2; ++i)
     {
-        // Child
-        if (dup2(fd, 1) < 0)
+        fds[i].fd = pipes[i][0];
+        fds[i].events = POLLIN;
+        if (pipes[i][1] >= 0)
         {
-            perror("dup2 failed");
-            _exit(-1);
+            // Only the child writes now, so the pipe reports end of file once the command exits
+            close(pipes[i][1]);
+            pipes[i][1] = -1;
+            open_pipes++;
         }
+    }
 
-        execv(command[0], command);
+    while (open_pipes > 0)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll failed");
+            break;
+        }
 
-        perror("execv failed");
-        _exit(-1);
+        for (i = 0; i < 2; ++i)
+        {
+            if (fds[i].fd < 0 || fds[i].revents == 0)
+            {
+                continue;
+            }
+
+            ssize_t bytes_read = capture_read(fds[i].fd, captures[i], growable[i]);
+            if (bytes_read < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes_read <= 0)
+            {
+                if (bytes_read < 0)
+                {
+                    perror("read failed");
+                }
+                // poll() ignores negative descriptors
+                fds[i].fd = -1;
+                open_pipes--;
+            }
+        }
     }
 
-    // Parent
-    int status;
-    if (waitpid(pid, &status, 0) < 0)
+    // Normally at end of file already, after a poll() failure the command gets SIGPIPE instead of blocking
+    for (i = 0; i < 2; ++i)
     {
-        perror("waitpid failed");
-        retval = false;
-        goto cleanup;
+        if (pipes[i][0] >= 0)
+        {
+            close(pipes[i][0]);
+            pipes[i][0] = -1;
+        }
     }
 
-    if (!WIFEXITED(status))
+    retval = wait_command(pid);
+
+cleanup:
+    for (i = 0; i < 2; ++i)
     {
-        printf("Child didn't exited normally\n");
-        retval = false;
+        if (pipes[i][0] >= 0)
+        {
+            close(pipes[i][0]);
+        }
+        if (pipes[i][1] >= 0)
+        {
+            close(pipes[i][1]);
+        }
+    }
+    posix_spawn_file_actions_destroy(&file_actions);
+    va_end(args);
+    return retval;
+}
+
+/**
+ * @return the exit status in @param info, 128 + the signal number for a command killed by a
+ *   signal, like the shell reports it
+ */
+static int command_status(const siginfo_t *info)
+{
+    if (info->si_code == CLD_EXITED)
+    {
+        return info->si_status;
+    }
+    return 128 + info->si_status;
+}
+
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Reaps the command at @param index of @param commands and marks it reaped in @param pids
+ */
+static void reap_batch_command(struct exec_batch_command *commands, size_t index, pid_t *pids)
+{
+    siginfo_t info;
+
+    memset(&info, 0, sizeof(info));
+    while (waitid(P_PID, pids[index], &info, WEXITED) < 0)
+    {
+        if (errno != EINTR)
+        {
+            perror("waitid failed");
+            pids[index] = -1;
+            return;
+        }
+    }
+    commands[index].status = command_status(&info);
+    pids[index] = -1;
+}
+
+/**
+* @param commands - The batch to run.  Every command's argv is NULL terminated and starts with
+*   the full path to the command, like the arguments of do_exec().  On return every command's
+*   status holds its exit status, 128 + the signal number if it was killed by a signal, or -1
+*   if it couldn't be started.
+* @param count - The number of commands in @param commands
+* @param max_parallel - The most commands running at the same time, at least 1
+* @return true if every command exited with 0, false otherwise
+*/
+bool do_exec_batch(struct exec_batch_command *commands, size_t count, int max_parallel)
+{
+/*
+ * Commands are started with posix_spawn() as long as fewer than max_parallel are running.
+ * Each running command is watched through a pidfd registered with epoll, which becomes
+ * readable once the command exited, so whichever finishes first is reaped first and its slot
+ * refilled right away.  Without pidfd support (Linux < 5.3) the oldest running command is
+ * waited for instead.
+ */
+    struct epoll_event events[EXEC_BATCH_MAX_EVENTS];
+    pid_t *pids = NULL;
+    int *pidfds = NULL;
+    int epoll_fd = -1;
+    size_t next = 0;
+    size_t oldest = 0;
+    int running = 0;
+    bool retval = false;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        commands[i].status = -1;
+    }
+
+    if (max_parallel < 1)
+    {
+        fprintf(stderr, "do_exec_batch needs max_parallel >= 1\n");
+        return false;
+    }
+
+    pids = calloc(count, sizeof(*pids));
+    pidfds = calloc(count, sizeof(*pidfds));
+    if (count > 0 && (pids == NULL || pidfds == NULL))
+    {
+        perror("calloc failed");
         goto cleanup;
     }
 
-    int command_retval = WEXITSTATUS(status);
-    if (command_retval != 0)
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
     {
-        printf("Command returned with %d", command_retval);
-        retval = false;
+        perror("epoll_create1 failed");
         goto cleanup;
     }
 
+    while (next < count || running > 0)
+    {
+        int ready;
+
+        while (next < count && running < max_parallel)
+        {
+            size_t index = next++;
+            struct epoll_event event = { .events = EPOLLIN, .data.u64 = index };
+
+            pidfds[index] = -1;
+            pids[index] = spawn_command(commands[index].argv, NULL);
+            if (pids[index] < 0)
+            {
+                continue;
+            }
+            running++;
+
+            pidfds[index] = open_pidfd(pids[index]);
+            if (pidfds[index] >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfds[index], &event) < 0)
+            {
+                perror("epoll_ctl failed");
+                close(pidfds[index]);
+                pidfds[index] = -1;
+            }
+        }
+
+        if (running == 0)
+        {
+            continue;
+        }
+
+        // Commands without a pidfd are waited for in the order they were started
+        while (oldest < next && pids[oldest] < 0)
+        {
+            oldest++;
+        }
+        if (oldest < next && pidfds[oldest] < 0)
+        {
+            reap_batch_command(commands, oldest, pids);
+            running--;
+            continue;
+        }
+
+        ready = epoll_wait(epoll_fd, events, EXEC_BATCH_MAX_EVENTS, -1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait failed");
+            goto cleanup;
+        }
+
+        for (int i = 0; i < ready; ++i)
+        {
+            size_t index = events[i].data.u64;
+
+            reap_batch_command(commands, index, pids);
+            /*
+             * A child started since may still hold a copy of the pidfd: posix_spawn() returns
+             * before the exec closed it.  Closing ours alone wouldn't take it out of the epoll set.
+             */
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pidfds[index], NULL);
+            close(pidfds[index]);
+            pidfds[index] = -1;
+            running--;
+        }
+    }
+
+    retval = true;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (commands[i].status != 0)
+        {
+            retval = false;
+        }
+    }
+
 cleanup:
-    close(fd);
-    va_end(args);
+    // Only reached with commands still running if epoll failed, don't leave them as zombies
+    for (size_t i = 0; running > 0 && i < next; ++i)
+    {
+        if (pids[i] > 0)
+        {
+            reap_batch_command(commands, i, pids);
+            running--;
+        }
+    }
+    for (size_t i = 0; pidfds != NULL && i < next; ++i)
+    {
+        if (pidfds[i] >= 0)
+        {
+            close(pidfds[i]);
+        }
+    }
+    if (epoll_fd >= 0)
+    {
+        close(epoll_fd);
+    }
+    free(pidfds);
+    free(pids);
     return retval;
 }
@@ -7,3 +7,32 @@ bool do_system(const char *command);
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * Where do_exec_capture() puts one output stream of the command.  Leave buffer NULL to have
+ * it allocated and grown as output arrives, the caller frees it.  The captured output is NUL
+ * terminated, so at most capacity - 1 bytes of a caller supplied buffer are used.
+ */
+struct exec_capture
+{
+    char *buffer;
+    size_t capacity;
+    // Most bytes kept, 0 for no limit besides the capacity of a caller supplied buffer
+    size_t limit;
+    // Set by do_exec_capture()
+    size_t length;
+    bool truncated;
+};
+
+bool do_exec_capture(struct exec_capture *out, struct exec_capture *err, int count, ...);
+
+/**
+ * One command of a do_exec_batch() batch
+ */
+struct exec_batch_command
+{
+    char *const *argv;
+    int status;
+};
+
+bool do_exec_batch(struct exec_batch_command *commands, size_t count, int max_parallel);
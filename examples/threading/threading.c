@@ -1,20 +1,89 @@
 #include "threading.h"
-#include <unistd.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 // Optional: use these functions to add debug or error prints to your application
 #define DEBUG_LOG(msg,...)
 //#define DEBUG_LOG(msg,...) printf("threading: " msg "\n" , ##__VA_ARGS__)
 #define ERROR_LOG(msg,...) printf("threading ERROR: " msg "\n" , ##__VA_ARGS__)
 
-void* threadfunc(void* thread_param)
+#define NSEC_PER_SEC 1000000000LL
+
+/*
+ * Waits spin on the clock for this many microseconds before their deadline instead of sleeping,
+ * as waking up from clock_nanosleep can take tens of microseconds on a loaded machine.  Off by
+ * default: under contention the spinning threads take CPU from the one holding the mutex.
+ */
+#ifndef THREADING_SPIN_US
+#define THREADING_SPIN_US 0
+#endif
+
+static void timespec_add_ns(struct timespec *ts, long long ns)
+{
+    long long total = ts->tv_nsec + ns;
+
+    ts->tv_sec += total / NSEC_PER_SEC;
+    ts->tv_nsec = total % NSEC_PER_SEC;
+    if (ts->tv_nsec < 0)
+    {
+        ts->tv_sec--;
+        ts->tv_nsec += NSEC_PER_SEC;
+    }
+}
+
+/* @return @param a - @param b in nanoseconds */
+static int64_t timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+    return (int64_t)(a->tv_sec - b->tv_sec) * NSEC_PER_SEC + (a->tv_nsec - b->tv_nsec);
+}
+
+/**
+ * Waits for CLOCK_MONOTONIC to reach @param deadline, sleeping until THREADING_SPIN_US before it
+ * and spinning from there.  @param now is set to the time the wait ended.
+ */
+static void sleep_until(const struct timespec *deadline, struct timespec *now)
 {
+    struct timespec wake = *deadline;
+
+    timespec_add_ns(&wake, -THREADING_SPIN_US * 1000LL);
+    clock_gettime(CLOCK_MONOTONIC, now);
+    if (timespec_diff_ns(&wake, now) > 0)
+    {
+        // Unlike most calls, clock_nanosleep returns the error instead of setting errno
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+        {
+        }
+        clock_gettime(CLOCK_MONOTONIC, now);
+    }
 
+    while (timespec_diff_ns(deadline, now) > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, now);
+    }
+}
+
+/**
+ * The task behind start_thread_obtaining_mutex and task_pool_submit_mutex_task, sets
+ * thread_complete_success in @param data
+ */
+static void obtain_and_release_mutex(struct thread_data *data)
+{
+    struct thread_timing *timing = &data->timing;
+    struct timespec deadline;
+    struct timespec requested;
+    struct timespec acquired;
+    struct timespec now;
     bool success = true;
-    struct thread_data* data = (struct thread_data*)thread_param;
 
-    usleep(data->wait_to_obtain_ms);
+    memset(timing, 0, sizeof(*timing));
+    clock_gettime(CLOCK_MONOTONIC, &timing->started);
+
+    deadline = timing->started;
+    timespec_add_ns(&deadline, data->wait_to_obtain_ms * 1000000LL);
+    sleep_until(&deadline, &requested);
+    timing->obtain_late_ns = timespec_diff_ns(&requested, &deadline);
 
     if (pthread_mutex_lock(data->mutex) != 0)
     {
@@ -22,8 +91,14 @@ void* threadfunc(void* thread_param)
         success = false;
         goto cleanup;
     }
+    clock_gettime(CLOCK_MONOTONIC, &acquired);
+    timing->lock_wait_ns = timespec_diff_ns(&acquired, &requested);
 
-    usleep(data->wait_to_release_ms);
+    deadline = acquired;
+    timespec_add_ns(&deadline, data->wait_to_release_ms * 1000000LL);
+    sleep_until(&deadline, &now);
+    timing->release_late_ns = timespec_diff_ns(&now, &deadline);
+    timing->hold_ns = timespec_diff_ns(&now, &acquired);
 
     if (pthread_mutex_unlock(data->mutex) != 0)
     {
@@ -34,6 +109,11 @@ void* threadfunc(void* thread_param)
 
 cleanup:
     data->thread_complete_success = success;
+}
+
+void* threadfunc(void* thread_param)
+{
+    obtain_and_release_mutex((struct thread_data*)thread_param);
     return thread_param;
 }
 
@@ -70,3 +150,160 @@ cleanup:
     return success;
 }
 
+
+struct task_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    // Queued tasks, linked through task_future.next
+    struct task_future *head;
+    struct task_future *tail;
+    bool shutting_down;
+    int worker_count;
+    pthread_t workers[];
+};
+
+static void* task_pool_worker(void* arg)
+{
+    struct task_pool *pool = (struct task_pool *)arg;
+    struct task_future *future;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (pool->head == NULL && !pool->shutting_down)
+        {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->head == NULL)
+        {
+            break;
+        }
+
+        future = pool->head;
+        pool->head = future->next;
+        if (pool->head == NULL)
+        {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        obtain_and_release_mutex(&future->data);
+
+        pthread_mutex_lock(&pool->lock);
+        future->done = true;
+        pthread_cond_signal(&future->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/**
+ * Stops the first @param started workers of @param pool once the queue is empty and frees it
+ */
+static void task_pool_shutdown(struct task_pool *pool, int started)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutting_down = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+struct task_pool *task_pool_create(int workers)
+{
+    struct task_pool *pool;
+
+    if (workers < 1)
+    {
+        ERROR_LOG("A task pool needs at least one worker");
+        return NULL;
+    }
+
+    pool = (struct task_pool *)calloc(1, sizeof(struct task_pool) + workers * sizeof(pthread_t));
+    if (pool == NULL)
+    {
+        ERROR_LOG("Failed allocating task pool");
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pool->worker_count = workers;
+
+    for (int i = 0; i < workers; i++)
+    {
+        if (pthread_create(&pool->workers[i], NULL, task_pool_worker, pool) != 0)
+        {
+            ERROR_LOG("Failed pthread_create");
+            task_pool_shutdown(pool, i);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+bool task_pool_submit_mutex_task(struct task_pool *pool, struct task_future *future, pthread_mutex_t *mutex,
+                                 int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    future->data.mutex = mutex;
+    future->data.wait_to_obtain_ms = wait_to_obtain_ms;
+    future->data.wait_to_release_ms = wait_to_release_ms;
+    future->data.thread_complete_success = false;
+    future->done = false;
+    future->next = NULL;
+    future->pool = pool;
+    if (pthread_cond_init(&future->done_cond, NULL) != 0)
+    {
+        ERROR_LOG("Failed pthread_cond_init");
+        return false;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail == NULL)
+    {
+        pool->head = future;
+    }
+    else
+    {
+        pool->tail->next = future;
+    }
+    pool->tail = future;
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return true;
+}
+
+bool task_future_wait(struct task_future *future)
+{
+    struct task_pool *pool = future->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!future->done)
+    {
+        pthread_cond_wait(&future->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    // The worker signalled with the pool lock held, so it's done with the condition variable
+    pthread_cond_destroy(&future->done_cond);
+    return future->data.thread_complete_success;
+}
+
+void task_pool_destroy(struct task_pool *pool)
+{
+    if (pool != NULL)
+    {
+        task_pool_shutdown(pool, pool->worker_count);
+    }
+}
@@ -1,5 +1,23 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <time.h>
+
+/**
+ * How the waits of a thread went, all times in nanoseconds on CLOCK_MONOTONIC.  The waits are
+ * scheduled against absolute deadlines, so the lateness of one doesn't shift the next.
+ */
+struct thread_timing
+{
+    // When the thread started, wait_to_obtain_ms counts from here
+    struct timespec started;
+    // How far past their deadlines the wait to obtain and the wait to release ended
+    int64_t obtain_late_ns;
+    int64_t release_late_ns;
+    // Time spent blocked obtaining the mutex, and holding it
+    int64_t lock_wait_ns;
+    int64_t hold_ns;
+};
 
 /**
  * This structure should be dynamically allocated and passed as
@@ -18,6 +36,11 @@ struct thread_data
      * if an error occurred.
      */
     bool thread_complete_success;
+
+    /**
+     * Filled in by the thread as it runs.
+     */
+    struct thread_timing timing;
 };
 
 
@@ -36,3 +59,45 @@ struct thread_data
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms);
+
+struct task_pool;
+
+/**
+ * Completion of a task submitted to a task_pool.  Owned by the caller, it must stay valid until
+ * task_future_wait() returned for it, and is free to be reused after that.
+ */
+struct task_future
+{
+    struct thread_data data;
+    bool done;
+    pthread_cond_t done_cond;
+    struct task_future *next;
+    struct task_pool *pool;
+};
+
+/**
+* Start @param workers threads which run submitted tasks one at a time, so at most @param workers
+* tasks run concurrently and no thread is created per task.
+* @return the pool, or NULL if it couldn't be created.
+*/
+struct task_pool *task_pool_create(int workers);
+
+/**
+* Queue the task start_thread_obtaining_mutex runs on a thread of its own, see there for
+* @param mutex, @param wait_to_obtain_ms and @param wait_to_release_ms, to run on a worker of
+* @param pool.  Its completion is reported through @param future.
+* @return true if the task was queued, false if a failure occurred.
+*/
+bool task_pool_submit_mutex_task(struct task_pool *pool, struct task_future *future, pthread_mutex_t *mutex,
+                                 int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* Block until the task of @param future completed, taking the place of pthread_join.
+* @return thread_complete_success of the task.
+*/
+bool task_future_wait(struct task_future *future);
+
+/**
+* Run every task still queued in @param pool, then stop its workers and free it.
+*/
+void task_pool_destroy(struct task_pool *pool);
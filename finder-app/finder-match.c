@@ -0,0 +1,170 @@
+/*
+ * finder-match.c
+ *
+ * The vectorized kernels compare a block of the data against the first byte of the pattern,
+ * and the block at pattern length - 1 further against its last byte, so only positions where
+ * both match are checked with memcmp (Wojciech Muła's "SIMD-friendly algorithms for substring
+ * searching").  Once a line matched, the rest of it is skipped with memchr for the newline.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MATCH_X86
+#endif
+
+#include "finder-match.h"
+
+typedef const char *(*find_function)(const char *haystack, size_t length);
+
+static const char *pattern;
+static size_t pattern_length;
+static find_function find;
+static const char *engine;
+
+static const char *find_scalar(const char *haystack, size_t length)
+{
+	return memmem(haystack, length, pattern, pattern_length);
+}
+
+#ifdef MATCH_X86
+/* Checks the candidates in @param mask, bit i standing for @param block + i */
+static inline const char *check_candidates(const char *block, uint32_t mask)
+{
+	while (mask != 0)
+	{
+		unsigned offset = __builtin_ctz(mask);
+
+		// The first and last bytes already matched
+		if (pattern_length <= 2 || memcmp(block + offset + 1, pattern + 1, pattern_length - 2) == 0)
+		{
+			return block + offset;
+		}
+		mask &= mask - 1;
+	}
+	return NULL;
+}
+
+__attribute__((target("sse2")))
+static const char *find_sse2(const char *haystack, size_t length)
+{
+	const __m128i first = _mm_set1_epi8(pattern[0]);
+	const __m128i last = _mm_set1_epi8(pattern[pattern_length - 1]);
+	size_t i = 0;
+
+	for (; i + pattern_length - 1 + sizeof(__m128i) <= length; i += sizeof(__m128i))
+	{
+		__m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + i));
+		__m128i block_last = _mm_loadu_si128((const __m128i *)(haystack + i + pattern_length - 1));
+		uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+								_mm_cmpeq_epi8(last, block_last)));
+		const char *match = check_candidates(haystack + i, mask);
+
+		if (match != NULL)
+		{
+			return match;
+		}
+	}
+	return find_scalar(haystack + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *haystack, size_t length)
+{
+	const __m256i first = _mm256_set1_epi8(pattern[0]);
+	const __m256i last = _mm256_set1_epi8(pattern[pattern_length - 1]);
+	size_t i = 0;
+
+	for (; i + pattern_length - 1 + sizeof(__m256i) <= length; i += sizeof(__m256i))
+	{
+		__m256i block_first = _mm256_loadu_si256((const __m256i *)(haystack + i));
+		__m256i block_last = _mm256_loadu_si256((const __m256i *)(haystack + i + pattern_length - 1));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+								      _mm256_cmpeq_epi8(last, block_last)));
+		const char *match = check_candidates(haystack + i, mask);
+
+		if (match != NULL)
+		{
+			return match;
+		}
+	}
+	return find_scalar(haystack + i, length - i);
+}
+#endif
+
+void match_init(const char *string, size_t length)
+{
+	const char *requested = getenv("FINDER_MATCH");
+
+	pattern = string;
+	pattern_length = length;
+	find = find_scalar;
+	engine = "scalar";
+
+#ifdef MATCH_X86
+	__builtin_cpu_init();
+	if (requested != NULL && strcmp(requested, "scalar") == 0)
+	{
+		return;
+	}
+	if (__builtin_cpu_supports("avx2") && (requested == NULL || strcmp(requested, "avx2") == 0))
+	{
+		find = find_avx2;
+		engine = "avx2";
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		find = find_sse2;
+		engine = "sse2";
+	}
+#else
+	(void)requested;
+#endif
+}
+
+const char *match_engine(void)
+{
+	return engine;
+}
+
+uint64_t count_matching_lines(const char *data, size_t length)
+{
+	const char *end = data + length;
+	uint64_t lines = 0;
+
+	if (pattern_length == 0)
+	{
+		// Every line matches
+		for (const char *line = data; line < end; lines++)
+		{
+			const char *newline = memchr(line, '\n', end - line);
+
+			line = newline != NULL ? newline + 1 : end;
+		}
+		return lines;
+	}
+
+	while (data < end)
+	{
+		const char *match = find(data, end - data);
+		const char *newline;
+
+		if (match == NULL)
+		{
+			break;
+		}
+		lines++;
+
+		// The rest of the line doesn't matter anymore
+		newline = memchr(match + pattern_length, '\n', end - (match + pattern_length));
+		if (newline == NULL)
+		{
+			break;
+		}
+		data = newline + 1;
+	}
+	return lines;
+}
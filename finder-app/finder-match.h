@@ -0,0 +1,29 @@
+/*
+ * finder-match.h
+ *
+ * Counting the lines of a buffer that contain a fixed string.
+ */
+
+#ifndef FINDER_MATCH_H
+#define FINDER_MATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sets the string count_matching_lines looks for, which must stay valid, and picks the search
+ * kernel for this CPU: avx2, sse2, or the memmem based scalar one elsewhere.  The FINDER_MATCH
+ * environment variable forces one of them, unless the CPU lacks it.
+ */
+void match_init(const char *pattern, size_t pattern_length);
+
+/* Name of the search kernel match_init picked, finder prints it when FINDER_MATCH is set */
+const char *match_engine(void);
+
+/*
+ * @return the number of lines in @param data containing the pattern, a last line without a
+ * newline included
+ */
+uint64_t count_matching_lines(const char *data, size_t length);
+
+#endif
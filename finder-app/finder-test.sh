@@ -52,10 +52,19 @@ fi
 #make clean
 #make
 
-for i in $( seq 1 $NUMFILES)
-do
-	writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+if [ $assignment != 'assignment1' ]
+then
+	# One writer process for all the files, the manifest lines are "name<TAB>string"
+	for i in $( seq 1 $NUMFILES)
+	do
+		printf '%s\t%s\n' "${username}$i.txt" "$WRITESTR"
+	done | writer -d "$WRITEDIR"
+else
+	for i in $( seq 1 $NUMFILES)
+	do
+		writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
+	done
+fi
 
 OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR")
 echo ${OUTPUTSTRING} > /tmp/assignment4-result.txt
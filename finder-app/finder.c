@@ -0,0 +1,369 @@
+/*
+ * finder DIRECTORY STRING
+ *	Native version of finder.sh: prints how many regular files are below DIRECTORY and how
+ *	many of their lines contain STRING, in the same format.  STRING is matched literally, so
+ *	finder.sh keeps using grep for patterns with regular expression characters.
+ *
+ * Both counts come out of a single walk of the tree, spread over one thread per CPU.  Every
+ * thread has a deque of directories and files to process: it pushes what it finds onto its own
+ * deque and takes from the back of it, and once it runs dry it steals from the front of the
+ * others, or sleeps until something is pushed.  Files are mapped and scanned in place by the
+ * kernels in finder-match.c.
+ *
+ * Like GNU grep (3.5 and later), files containing a NUL byte are considered binary and add no
+ * lines to the count, and symbolic links aren't followed.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "finder-match.h"
+
+#define MAX_THREADS 64
+#define INITIAL_QUEUE_CAPACITY 256
+#define CACHE_LINE_SIZE 64
+
+struct work_item
+{
+	char *path;
+	bool is_directory;
+};
+
+/* Deque of work_items[head, tail) */
+struct worker
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct work_item *items;
+	size_t head;
+	size_t tail;
+	size_t capacity;
+	uint64_t files;
+	uint64_t lines;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct worker *workers;
+static int worker_count;
+// Items queued or being processed, the walk is over once it drops to 0
+static size_t pending;
+// Items queued in any deque, idle workers sleep on work_cond while it's 0
+static size_t queued;
+static int idle_workers;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+
+static void push(struct worker *worker, char *path, bool is_directory)
+{
+	__atomic_fetch_add(&pending, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->tail == worker->capacity)
+	{
+		if (worker->head > 0)
+		{
+			memmove(worker->items, worker->items + worker->head,
+				(worker->tail - worker->head) * sizeof(struct work_item));
+			worker->tail -= worker->head;
+			worker->head = 0;
+		}
+		else
+		{
+			size_t capacity = worker->capacity == 0 ? INITIAL_QUEUE_CAPACITY : worker->capacity * 2;
+			struct work_item *items = realloc(worker->items, capacity * sizeof(struct work_item));
+
+			if (items == NULL)
+			{
+				pthread_mutex_unlock(&worker->lock);
+				fprintf(stderr, "finder: out of memory\n");
+				exit(1);
+			}
+			worker->items = items;
+			worker->capacity = capacity;
+		}
+	}
+	worker->items[worker->tail].path = path;
+	worker->items[worker->tail].is_directory = is_directory;
+	worker->tail++;
+	/*
+	 * Either this sees the idle worker, or the worker sees the item before it sleeps: both sides
+	 * publish their counter before reading the other's
+	 */
+	__atomic_fetch_add(&queued, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&worker->lock);
+
+	if (__atomic_load_n(&idle_workers, __ATOMIC_SEQ_CST) > 0)
+	{
+		pthread_mutex_lock(&idle_lock);
+		pthread_cond_signal(&work_cond);
+		pthread_mutex_unlock(&idle_lock);
+	}
+}
+
+/* Takes the most recently pushed item of @param worker, for its own thread */
+static bool pop(struct worker *worker, struct work_item *item)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->tail > worker->head)
+	{
+		*item = worker->items[--worker->tail];
+		__atomic_fetch_sub(&queued, 1, __ATOMIC_RELAXED);
+		found = true;
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return found;
+}
+
+/* Takes the oldest item of @param victim, which tends to be the largest piece of work */
+static bool steal(struct worker *victim, struct work_item *item)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&victim->lock);
+	if (victim->tail > victim->head)
+	{
+		*item = victim->items[victim->head++];
+		__atomic_fetch_sub(&queued, 1, __ATOMIC_RELAXED);
+		found = true;
+	}
+	pthread_mutex_unlock(&victim->lock);
+	return found;
+}
+
+static void scan_file(struct worker *worker, const char *path)
+{
+	struct stat st;
+	char *data;
+	int fd;
+
+	worker->files++;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+	if (fd == -1)
+	{
+		fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+		return;
+	}
+	if (fstat(fd, &st) == -1)
+	{
+		fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+		goto cleanup;
+	}
+	if (st.st_size == 0)
+	{
+		goto cleanup;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+	{
+		fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+		goto cleanup;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	if (memchr(data, '\0', st.st_size) == NULL)
+	{
+		worker->lines += count_matching_lines(data, st.st_size);
+	}
+	munmap(data, st.st_size);
+
+cleanup:
+	close(fd);
+}
+
+static char *join_path(const char *directory, const char *name)
+{
+	size_t directory_length = strlen(directory);
+	size_t name_length = strlen(name);
+	char *path = malloc(directory_length + name_length + 2);
+
+	if (path == NULL)
+	{
+		fprintf(stderr, "finder: out of memory\n");
+		exit(1);
+	}
+	memcpy(path, directory, directory_length);
+	path[directory_length] = '/';
+	memcpy(path + directory_length + 1, name, name_length + 1);
+	return path;
+}
+
+static void walk_directory(struct worker *worker, const char *path)
+{
+	DIR *directory = opendir(path);
+	struct dirent *entry;
+
+	if (directory == NULL)
+	{
+		fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	while ((entry = readdir(directory)) != NULL)
+	{
+		unsigned char type = entry->d_type;
+
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+		{
+			continue;
+		}
+
+		if (type == DT_UNKNOWN)
+		{
+			struct stat st;
+
+			// Not every file system fills in d_type
+			if (fstatat(dirfd(directory), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+			{
+				continue;
+			}
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		if (type == DT_DIR || type == DT_REG)
+		{
+			push(worker, join_path(path, entry->d_name), type == DT_DIR);
+		}
+	}
+	closedir(directory);
+}
+
+static void *worker_func(void *arg)
+{
+	struct worker *worker = (struct worker *)arg;
+	int self = worker - workers;
+
+	while (1)
+	{
+		struct work_item item;
+		bool found = pop(worker, &item);
+
+		for (int i = 1; !found && i < worker_count; i++)
+		{
+			found = steal(&workers[(self + i) % worker_count], &item);
+		}
+
+		if (!found)
+		{
+			bool done;
+
+			// One thread often walks a deep, narrow tree alone, the others mustn't spin meanwhile
+			pthread_mutex_lock(&idle_lock);
+			__atomic_fetch_add(&idle_workers, 1, __ATOMIC_SEQ_CST);
+			while (__atomic_load_n(&queued, __ATOMIC_SEQ_CST) == 0 &&
+			       __atomic_load_n(&pending, __ATOMIC_ACQUIRE) != 0)
+			{
+				pthread_cond_wait(&work_cond, &idle_lock);
+			}
+			__atomic_fetch_sub(&idle_workers, 1, __ATOMIC_RELAXED);
+			done = __atomic_load_n(&pending, __ATOMIC_ACQUIRE) == 0;
+			pthread_mutex_unlock(&idle_lock);
+			if (done)
+			{
+				break;
+			}
+			continue;
+		}
+
+		if (item.is_directory)
+		{
+			walk_directory(worker, item.path);
+		}
+		else
+		{
+			scan_file(worker, item.path);
+		}
+		free(item.path);
+		// Only after the children were pushed, so pending can't reach 0 early
+		if (__atomic_fetch_sub(&pending, 1, __ATOMIC_RELEASE) == 1)
+		{
+			pthread_mutex_lock(&idle_lock);
+			pthread_cond_broadcast(&work_cond);
+			pthread_mutex_unlock(&idle_lock);
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct stat st;
+	uint64_t files = 0;
+	uint64_t lines = 0;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	char *root;
+
+	if (argc != 3)
+	{
+		printf("Should receive 2 args exactly\n");
+		return 1;
+	}
+	if (stat(argv[1], &st) == -1 || !S_ISDIR(st.st_mode))
+	{
+		printf("Error: '%s' is not a valid directory.\n", argv[1]);
+		return 1;
+	}
+
+	match_init(argv[2], strlen(argv[2]));
+	// A forced kernel the CPU lacks falls back quietly otherwise, see finder-bench.sh
+	if (getenv("FINDER_MATCH") != NULL)
+	{
+		fprintf(stderr, "finder: using the %s search kernel\n", match_engine());
+	}
+	worker_count = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : cpus;
+	workers = aligned_alloc(CACHE_LINE_SIZE, worker_count * sizeof(struct worker));
+	root = strdup(argv[1]);
+	if (workers == NULL || root == NULL)
+	{
+		fprintf(stderr, "finder: out of memory\n");
+		return 1;
+	}
+	memset(workers, 0, worker_count * sizeof(struct worker));
+	for (int i = 0; i < worker_count; i++)
+	{
+		pthread_mutex_init(&workers[i].lock, NULL);
+	}
+	push(&workers[0], root, true);
+
+	// The calling thread is worker 0
+	for (int i = 1; i < worker_count; i++)
+	{
+		if (pthread_create(&workers[i].thread, NULL, worker_func, &workers[i]) != 0)
+		{
+			fprintf(stderr, "finder: failed to start a thread\n");
+			return 1;
+		}
+	}
+	worker_func(&workers[0]);
+	for (int i = 1; i < worker_count; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	for (int i = 0; i < worker_count; i++)
+	{
+		files += workers[i].files;
+		lines += workers[i].lines;
+		pthread_mutex_destroy(&workers[i].lock);
+		free(workers[i].items);
+	}
+	free(workers);
+
+	printf("The number of files are %llu and the number of matching lines are %llu\n",
+	       (unsigned long long)files, (unsigned long long)lines);
+	return 0;
+}
@@ -10,6 +10,19 @@ if [ ! -d "$1" ]; then
     exit 1
 fi
 
+# The native finder counts both in a single pass, but only matches the string literally
+case "$2" in
+""|-*|*[][.*^$\\]*|*[[:space:]]*)
+    ;;
+*)
+    # Only the one installed alongside, a finder elsewhere on PATH may be something else entirely
+    finder_bin="$(dirname "$0")/finder"
+    if [ -x "$finder_bin" ]; then
+        exec "$finder_bin" "$1" "$2"
+    fi
+    ;;
+esac
+
 num_files=$(find $1 -type f | wc -l)
 num_matches=$(grep -r $2 $1 | wc -l)
 
@@ -105,6 +105,7 @@ make clean
 make
 
 cp writer ${OUTDIR}/rootfs/home
+cp finder ${OUTDIR}/rootfs/home
 cp finder.sh ${OUTDIR}/rootfs/home
 cp finder-test.sh ${OUTDIR}/rootfs/home
 cp autorun-qemu.sh ${OUTDIR}/rootfs/home
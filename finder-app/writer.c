@@ -1,3 +1,18 @@
+/*
+ * writer FILE STRING
+ *	Writes STRING to FILE.
+ *
+ * writer -d DIRECTORY [-j THREADS] < MANIFEST
+ *	Bulk mode: every line of MANIFEST is a file name relative to DIRECTORY, a tab and the
+ *	string to write to it, e.g. "name1.txt\tAELD_IS_FUN".  The files are created or truncated
+ *	with openat() on DIRECTORY and written by THREADS threads (default: one per CPU, at most
+ *	MAX_THREADS), so generating thousands of files costs one process launch instead of
+ *	thousands.
+ *
+ * Options are only parsed when the first argument is -d or -j, so any other FILE, including one
+ * starting with '-', is written as before.  A file named -d or -j has to be given as ./-d or ./-j.
+ */
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
@@ -6,31 +21,332 @@
 #include <syslog.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define MAX_THREADS 16
+#define MANIFEST_READ_SIZE 65536
 
-int main(int argc, char const *argv[])
+struct manifest_entry
 {
-	openlog(NULL, 0, LOG_USER);
+	const char *name;
+	const char *contents;
+	size_t length;
+};
 
-	if (argc != 3)
+struct bulk_job
+{
+	int dir_fd;
+	struct manifest_entry *entries;
+	size_t count;
+	// Next entry to write, claimed with an atomic increment
+	size_t next;
+	size_t failed;
+};
+
+static int write_file(int dir_fd, const char *name, int flags, const char *contents, size_t length)
+{
+	int fd = openat(dir_fd, name, flags | O_CLOEXEC, 0666);
+	size_t written = 0;
+
+	if (fd == -1)
+	{
+		syslog(LOG_ERR, "Failed to open file %s: %s", name, strerror(errno));
+		return -1;
+	}
+
+	while (written < length)
+	{
+		ssize_t ret = write(fd, contents + written, length - written);
+
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			syslog(LOG_ERR, "Failed to write the string to %s: %s", name, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		written += ret;
+	}
+
+	if (close(fd) == -1)
+	{
+		syslog(LOG_ERR, "Failed to close %s: %s", name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void *bulk_worker(void *arg)
+{
+	struct bulk_job *job = (struct bulk_job *)arg;
+	size_t index;
+
+	while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+	{
+		struct manifest_entry *entry = &job->entries[index];
+
+		if (write_file(job->dir_fd, entry->name, O_WRONLY | O_CREAT | O_TRUNC,
+			       entry->contents, entry->length) != 0)
+		{
+			__atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+/* Reads all of stdin into a NUL terminated buffer, @return NULL on failure */
+static char *read_manifest(size_t *length)
+{
+	size_t capacity = MANIFEST_READ_SIZE;
+	char *buffer = malloc(capacity + 1);
+
+	*length = 0;
+	if (buffer == NULL)
+	{
+		goto out_of_memory;
+	}
+
+	while (1)
+	{
+		ssize_t ret;
+
+		if (capacity - *length < MANIFEST_READ_SIZE)
+		{
+			char *grown = realloc(buffer, capacity * 2 + 1);
+
+			if (grown == NULL)
+			{
+				goto out_of_memory;
+			}
+			buffer = grown;
+			capacity *= 2;
+		}
+
+		ret = read(STDIN_FILENO, buffer + *length, capacity - *length);
+		if (ret == 0)
+		{
+			break;
+		}
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			syslog(LOG_ERR, "Failed to read the manifest: %s", strerror(errno));
+			free(buffer);
+			return NULL;
+		}
+		*length += ret;
+	}
+
+	buffer[*length] = '\0';
+	return buffer;
+
+out_of_memory:
+	syslog(LOG_ERR, "Out of memory reading the manifest");
+	free(buffer);
+	return NULL;
+}
+
+/*
+ * Splits @param manifest in place into @param entries, one per non empty line.
+ * @return the number of entries, or -1 if a line has no tab or memory ran out
+ */
+static ssize_t parse_manifest(char *manifest, size_t length, struct manifest_entry **entries)
+{
+	size_t capacity = 0;
+	size_t count = 0;
+	char *line = manifest;
+	char *end = manifest + length;
+
+	*entries = NULL;
+	while (line < end)
+	{
+		char *newline = memchr(line, '\n', end - line);
+		char *line_end = newline != NULL ? newline : end;
+		char *tab;
+
+		if (line_end == line)
+		{
+			line = line_end + 1;
+			continue;
+		}
+
+		tab = memchr(line, '\t', line_end - line);
+		if (tab == NULL)
+		{
+			syslog(LOG_ERR, "Manifest entry %zu has no tab between the file name and the string", count + 1);
+			goto error;
+		}
+
+		if (count == capacity)
+		{
+			struct manifest_entry *grown;
+
+			capacity = capacity == 0 ? 1024 : capacity * 2;
+			grown = realloc(*entries, capacity * sizeof(struct manifest_entry));
+			if (grown == NULL)
+			{
+				syslog(LOG_ERR, "Out of memory parsing the manifest");
+				goto error;
+			}
+			*entries = grown;
+		}
+
+		*tab = '\0';
+		*line_end = '\0';
+		(*entries)[count].name = line;
+		(*entries)[count].contents = tab + 1;
+		(*entries)[count].length = line_end - (tab + 1);
+		count++;
+		line = line_end + 1;
+	}
+	return count;
+
+error:
+	free(*entries);
+	*entries = NULL;
+	return -1;
+}
+
+static int bulk_write(const char *directory, int threads)
+{
+	struct bulk_job job = { .dir_fd = -1 };
+	pthread_t workers[MAX_THREADS];
+	int started = 0;
+	char *manifest;
+	size_t length;
+	ssize_t count;
+	int ret = 1;
+
+	manifest = read_manifest(&length);
+	if (manifest == NULL)
 	{
-		syslog(LOG_ERR, "Should receive 2 args but %d was given", argc -1);
 		return 1;
 	}
-	syslog(LOG_DEBUG, "Wrinting %s to %s", argv[2], argv[1]);
 
-	int fd = open(argv[1], O_RDWR | O_CREAT, 0666);
-	if (fd == -1)
+	count = parse_manifest(manifest, length, &job.entries);
+	if (count < 0)
+	{
+		goto cleanup;
+	}
+	job.count = count;
+
+	job.dir_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (job.dir_fd == -1)
+	{
+		syslog(LOG_ERR, "Failed to open directory %s: %s", directory, strerror(errno));
+		goto cleanup;
+	}
+
+	if ((size_t)threads > job.count)
 	{
-		syslog(LOG_ERR, "Failed to open file %s", argv[1]);
+		threads = job.count;
+	}
+	syslog(LOG_DEBUG, "Writing %zu files to %s with %d threads", job.count, directory, threads);
+
+	// The calling thread works too
+	for (; started < threads - 1; started++)
+	{
+		if (pthread_create(&workers[started], NULL, bulk_worker, &job) != 0)
+		{
+			syslog(LOG_WARNING, "Failed to start a writer thread, continuing with %d", started + 1);
+			break;
+		}
+	}
+	bulk_worker(&job);
+	for (int i = 0; i < started; i++)
+	{
+		pthread_join(workers[i], NULL);
+	}
+
+	if (job.failed > 0)
+	{
+		syslog(LOG_ERR, "Failed to write %zu of %zu files", job.failed, job.count);
+		goto cleanup;
+	}
+	ret = 0;
+
+cleanup:
+	if (job.dir_fd != -1)
+	{
+		close(job.dir_fd);
+	}
+	free(job.entries);
+	free(manifest);
+	return ret;
+}
+
+static bool is_bulk_option(const char *arg)
+{
+	return strcmp(arg, "-d") == 0 || strcmp(arg, "-j") == 0;
+}
+
+static int bulk_main(int argc, char *argv[])
+{
+	const char *directory = NULL;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+
+	while ((opt = getopt(argc, argv, "+d:j:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			directory = optarg;
+			break;
+		case 'j':
+			threads = strtol(optarg, NULL, 10);
+			if (threads <= 0)
+			{
+				syslog(LOG_ERR, "Invalid number of threads %s", optarg);
+				return 1;
+			}
+			break;
+		default:
+			syslog(LOG_ERR, "Usage: %s FILE STRING | -d DIRECTORY [-j THREADS] < MANIFEST", argv[0]);
+			return 1;
+		}
+	}
+
+	if (directory == NULL)
+	{
+		syslog(LOG_ERR, "Bulk mode needs -d DIRECTORY");
+		return 1;
+	}
+	if (optind != argc)
+	{
+		syslog(LOG_ERR, "Bulk mode takes no arguments besides its options");
 		return 1;
 	}
+	if (threads < 1)
+	{
+		threads = 1;
+	}
+	return bulk_write(directory, threads > MAX_THREADS ? MAX_THREADS : threads);
+}
+
+int main(int argc, char *argv[])
+{
+	openlog(NULL, 0, LOG_USER);
 
-	if (write(fd, argv[2], strlen(argv[2])) < strlen(argv[2]))
+	if (argc > 1 && is_bulk_option(argv[1]))
 	{
-		syslog(LOG_ERR, "Failed to write the string to the file");
+		return bulk_main(argc, argv);
+	}
+
+	if (argc != 3)
+	{
+		syslog(LOG_ERR, "Should receive 2 args but %d was given", argc - 1);
 		return 1;
 	}
+	syslog(LOG_DEBUG, "Wrinting %s to %s", argv[2], argv[1]);
 
-	close(fd);
-	return 0;
+	return write_file(AT_FDCWD, argv[1], O_RDWR | O_CREAT, argv[2], strlen(argv[2])) == 0 ? 0 : 1;
 }
@@ -0,0 +1,598 @@
+/*
+ * aesdsocket-cache.c
+ *
+ * In-memory view of DATA_FILE, so replaying the contents to a client is a few references to
+ * memory queued for it instead of a re-read of the file or the char device for every packet.
+ * Appends made through replay_cache_append() go to the data file first, which stays the
+ * durable copy.
+ *
+ * The regular file is simply mapped, with room to grow so most appends don't need a new
+ * mapping.  The char device can't be mapped, so it gets a mirror kept in fixed size chunks
+ * instead.  Appends are added to the mirror when nothing else wrote in between, which the
+ * driver reports through a generation bumped by every write, see AESDCHAR_IOCVERSION.
+ * Any other change reloads the mirror before the next replay.
+ *
+ * Both are made of reference counted blocks, the chunks or the mappings.  The data file only ever
+ * grows, so the bytes a reply pinned never change, and the cache drops its own reference when it
+ * evicts a chunk or replaces a mapping, leaving the block to whoever still sends from it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "aesdsocket.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+#define CHUNK_SIZE (64 * 1024)
+// Buffers handed to a single writev(), well under IOV_MAX
+#define MAX_IOVECS 64
+// Smallest mapping of the data file, mappings grow to twice the file size
+#define MIN_MAP_SIZE (1024 * 1024)
+
+struct replay_block
+{
+    int refs;
+    char *data;
+#ifndef USE_AESD_CHAR_DEVICE
+    size_t size;
+#endif
+};
+
+struct replay_cache
+{
+    int fd;
+#ifdef USE_AESD_CHAR_DEVICE
+    struct replay_block **chunks;
+    size_t num_chunks;
+    size_t max_chunks;
+    // Offset of the first byte of the mirror in chunks[0], the char device drops old writes
+    size_t head;
+    size_t size;
+    bool valid;
+    uint64_t generation;
+    uint64_t pending;
+#else
+    // Only the first size bytes are ever touched, the rest is headroom past the end of the file
+    struct replay_block *map;
+    size_t size;
+    ino_t ino;
+#endif
+};
+
+struct replay_cache *replay_cache_create(void)
+{
+    struct replay_cache *cache = calloc(1, sizeof(*cache));
+
+    if (cache == NULL)
+    {
+        log_msg(LOG_ERR, "malloc failed");
+        return NULL;
+    }
+    cache->fd = -1;
+    return cache;
+}
+
+void replay_block_get(struct replay_block *block)
+{
+    __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+}
+
+void replay_block_put(struct replay_block *block)
+{
+    if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+#ifndef USE_AESD_CHAR_DEVICE
+    munmap(block->data, block->size);
+#endif
+    free(block);
+}
+
+#ifdef USE_AESD_CHAR_DEVICE
+
+static void cache_clear(struct replay_cache *cache)
+{
+    for (size_t i = 0; i < cache->num_chunks; ++i)
+    {
+        replay_block_put(cache->chunks[i]);
+    }
+    cache->num_chunks = 0;
+    cache->head = 0;
+    cache->size = 0;
+    cache->valid = false;
+}
+
+/**
+ * @return the free space at the end of the mirror, adding a chunk if the last one is full,
+ * or NULL if that failed.  @param space is set to the number of bytes available there.
+ */
+static char *cache_tail(struct replay_cache *cache, size_t *space)
+{
+    size_t end = cache->head + cache->size;
+    struct replay_block *chunk;
+
+    if (end == cache->num_chunks * CHUNK_SIZE)
+    {
+        if (cache->num_chunks == cache->max_chunks)
+        {
+            size_t max_chunks = cache->max_chunks ? cache->max_chunks * 2 : 16;
+            struct replay_block **chunks = realloc(cache->chunks, max_chunks * sizeof(*chunks));
+
+            if (chunks == NULL)
+            {
+                return NULL;
+            }
+            cache->chunks = chunks;
+            cache->max_chunks = max_chunks;
+        }
+
+        chunk = malloc(sizeof(*chunk) + CHUNK_SIZE);
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+        chunk->refs = 1;
+        chunk->data = (char *)(chunk + 1);
+        cache->chunks[cache->num_chunks++] = chunk;
+    }
+
+    *space = CHUNK_SIZE - end % CHUNK_SIZE;
+    return cache->chunks[end / CHUNK_SIZE]->data + end % CHUNK_SIZE;
+}
+
+static int cache_put(struct replay_cache *cache, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t space;
+        char *tail = cache_tail(cache, &space);
+
+        if (tail == NULL)
+        {
+            log_msg(LOG_ERR, "malloc failed");
+            return -1;
+        }
+        if (space > len)
+        {
+            space = len;
+        }
+        memcpy(tail, data, space);
+        cache->size += space;
+        data += space;
+        len -= space;
+    }
+    return 0;
+}
+
+/**
+ * Appends everything in the data file from @param offset on to the mirror
+ */
+static int cache_read_from(struct replay_cache *cache, off_t offset)
+{
+    while (1)
+    {
+        size_t space;
+        ssize_t bytes_read;
+        char *tail = cache_tail(cache, &space);
+
+        if (tail == NULL)
+        {
+            log_msg(LOG_ERR, "malloc failed");
+            return -1;
+        }
+
+        bytes_read = pread(cache->fd, tail, space, offset);
+        if (bytes_read < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            log_msg(LOG_ERR, "reading %s failed: %s", DATA_FILE, strerror(errno));
+            return -1;
+        }
+        if (bytes_read == 0)
+        {
+            return 0;
+        }
+        cache->size += bytes_read;
+        offset += bytes_read;
+    }
+}
+
+/* Drops the oldest @param len bytes, the way the driver evicts its oldest writes */
+static void cache_drop_front(struct replay_cache *cache, size_t len)
+{
+    size_t whole_chunks;
+
+    cache->head += len;
+    cache->size -= len;
+
+    whole_chunks = cache->head / CHUNK_SIZE;
+    if (whole_chunks > 0)
+    {
+        for (size_t i = 0; i < whole_chunks; ++i)
+        {
+            replay_block_put(cache->chunks[i]);
+        }
+        memmove(cache->chunks, cache->chunks + whole_chunks, (cache->num_chunks - whole_chunks) * sizeof(*cache->chunks));
+        cache->num_chunks -= whole_chunks;
+        cache->head -= whole_chunks * CHUNK_SIZE;
+    }
+}
+
+static int cache_sync(struct replay_cache *cache)
+{
+    struct aesd_version before;
+    struct aesd_version after;
+
+    if (ioctl(cache->fd, AESDCHAR_IOCVERSION, &before) != 0)
+    {
+        // Driver without AESDCHAR_IOCVERSION, nothing tells when the mirror goes stale
+        cache_clear(cache);
+        return cache_read_from(cache, 0);
+    }
+
+    if (cache->valid && before.generation == cache->generation)
+    {
+        return 0;
+    }
+
+    // A write landing during the reload may or may not be in what was read, so read it again
+    while (1)
+    {
+        cache_clear(cache);
+        if (cache_read_from(cache, 0) != 0 || ioctl(cache->fd, AESDCHAR_IOCVERSION, &after) != 0)
+        {
+            cache_clear(cache);
+            return -1;
+        }
+        if (after.generation == before.generation)
+        {
+            break;
+        }
+        before = after;
+    }
+
+    cache->generation = after.generation;
+    cache->pending = after.pending;
+    cache->valid = true;
+    return 0;
+}
+
+/*
+ * Called after @param data was written on top of a mirror which was in sync.  When that write is
+ * the only one since, the new contents follow from the old: a command completed by the write is
+ * appended and the driver evicted the oldest commands until it was back to version->size bytes.
+ */
+static void cache_apply_write(struct replay_cache *cache, const char *data, size_t len,
+                              const struct aesd_version *version)
+{
+    if (!cache->valid || version->generation != cache->generation + 1)
+    {
+        cache->valid = false;
+        return;
+    }
+
+    if (memchr(data, '\n', len) == NULL)
+    {
+        // Held back by the driver until the command is completed
+        cache->pending += len;
+    }
+    else if (cache->pending == 0 && version->pending == 0)
+    {
+        if (cache_put(cache, data, len) != 0 || cache->size < version->size)
+        {
+            cache->valid = false;
+            return;
+        }
+        cache_drop_front(cache, cache->size - version->size);
+    }
+    else
+    {
+        // Completes a command started by someone else, whose bytes the mirror never saw
+        cache->valid = false;
+        return;
+    }
+
+    cache->generation = version->generation;
+}
+
+static int cache_write(struct replay_cache *cache, const char *data, size_t len)
+{
+    struct aesd_version version;
+    size_t written = 0;
+    ssize_t retval;
+
+    // Bring the mirror up to date first, so the write below is the only change to account for
+    if (cache_sync(cache) != 0)
+    {
+        cache->valid = false;
+    }
+
+    while (written < len)
+    {
+        retval = write(cache->fd, data + written, len - written);
+        if (retval < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            log_msg(LOG_ERR, "writing %s failed: %s", DATA_FILE, strerror(errno));
+            cache->valid = false;
+            return -1;
+        }
+        written += retval;
+    }
+
+    if (ioctl(cache->fd, AESDCHAR_IOCVERSION, &version) != 0)
+    {
+        cache->valid = false;
+        return 0;
+    }
+    cache_apply_write(cache, data, len, &version);
+    return 0;
+}
+
+/* Queues the mirror from @param offset on chunk by chunk, the caller holds the data file mutex */
+static int cache_pin(struct replay_cache *cache, struct output_queue *queue, size_t offset)
+{
+    size_t position = cache->head + offset;
+    size_t remaining = cache->size - offset;
+
+    while (remaining > 0)
+    {
+        struct replay_block *chunk = cache->chunks[position / CHUNK_SIZE];
+        size_t start = position % CHUNK_SIZE;
+        size_t len = CHUNK_SIZE - start;
+
+        if (len > remaining)
+        {
+            len = remaining;
+        }
+        if (output_queue_push(queue, chunk, chunk->data + start, len) != 0)
+        {
+            return -1;
+        }
+        position += len;
+        remaining -= len;
+    }
+    return 0;
+}
+
+#else
+
+static void cache_unmap(struct replay_cache *cache)
+{
+    if (cache->map != NULL)
+    {
+        replay_block_put(cache->map);
+        cache->map = NULL;
+    }
+    cache->size = 0;
+}
+
+/*
+ * Maps everything currently in DATA_FILE.  Appends land in the headroom of the existing mapping,
+ * so it's only replaced once the file outgrows it.
+ */
+static int cache_sync(struct replay_cache *cache)
+{
+    struct stat st;
+    size_t map_size;
+    struct replay_block *map;
+
+    if (fstat(cache->fd, &st) != 0)
+    {
+        log_msg(LOG_ERR, "fstat(%s) failed: %s", DATA_FILE, strerror(errno));
+        return -1;
+    }
+
+    cache->size = st.st_size;
+    if (cache->size == 0 || (cache->map != NULL && cache->size <= cache->map->size))
+    {
+        return 0;
+    }
+
+    map_size = cache->size * 2;
+    if (map_size < MIN_MAP_SIZE)
+    {
+        map_size = MIN_MAP_SIZE;
+    }
+
+    map = malloc(sizeof(*map));
+    if (map == NULL)
+    {
+        log_msg(LOG_ERR, "malloc failed");
+        cache_unmap(cache);
+        return -1;
+    }
+
+    map->data = mmap(NULL, map_size, PROT_READ, MAP_SHARED, cache->fd, 0);
+    if (map->data == MAP_FAILED)
+    {
+        log_msg(LOG_ERR, "mmap(%s) failed: %s", DATA_FILE, strerror(errno));
+        free(map);
+        cache_unmap(cache);
+        return -1;
+    }
+    map->refs = 1;
+    map->size = map_size;
+
+    // Replies still sending from the old mapping keep it until they're done
+    if (cache->map != NULL)
+    {
+        replay_block_put(cache->map);
+    }
+    cache->map = map;
+    return 0;
+}
+
+static int cache_pin(struct replay_cache *cache, struct output_queue *queue, size_t offset)
+{
+    if (cache->map == NULL)
+    {
+        return 0;
+    }
+    return output_queue_push(queue, cache->map, cache->map->data + offset, cache->size - offset);
+}
+
+/* Appends all of @param iov with as few writev() calls as the file takes */
+static int cache_writev(struct replay_cache *cache, const struct iovec *iov, int iovcnt)
+{
+    struct iovec remaining[MAX_IOVECS];
+    struct iovec *next = remaining;
+    ssize_t written;
+
+    if (iovcnt > MAX_IOVECS)
+    {
+        log_msg(LOG_ERR, "too many buffers to append: %d", iovcnt);
+        return -1;
+    }
+    memcpy(remaining, iov, iovcnt * sizeof(*iov));
+
+    while (iovcnt > 0)
+    {
+        written = writev(cache->fd, next, iovcnt);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            log_msg(LOG_ERR, "writing %s failed: %s", DATA_FILE, strerror(errno));
+            return -1;
+        }
+
+        while (iovcnt > 0 && (size_t)written >= next->iov_len)
+        {
+            written -= next->iov_len;
+            next++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+#endif
+
+static int cache_open(struct replay_cache *cache)
+{
+#ifdef USE_AESD_CHAR_DEVICE
+    if (cache->fd != -1)
+    {
+        return 0;
+    }
+#else
+    struct stat st;
+
+    // DATA_FILE may have been removed or replaced, follow the name like the fopen() per packet used to
+    if (cache->fd != -1)
+    {
+        if (stat(DATA_FILE, &st) == 0 && st.st_ino == cache->ino)
+        {
+            return 0;
+        }
+        cache_unmap(cache);
+        close(cache->fd);
+        cache->fd = -1;
+    }
+#endif
+
+    cache->fd = open(DATA_FILE, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (cache->fd == -1)
+    {
+        log_msg(LOG_ERR, "open(%s) failed: %s", DATA_FILE, strerror(errno));
+        return -1;
+    }
+
+#ifndef USE_AESD_CHAR_DEVICE
+    if (fstat(cache->fd, &st) != 0)
+    {
+        log_msg(LOG_ERR, "fstat(%s) failed: %s", DATA_FILE, strerror(errno));
+        close(cache->fd);
+        cache->fd = -1;
+        return -1;
+    }
+    cache->ino = st.st_ino;
+#endif
+    return 0;
+}
+
+void replay_cache_destroy(struct replay_cache *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+#ifdef USE_AESD_CHAR_DEVICE
+    cache_clear(cache);
+    free(cache->chunks);
+#else
+    cache_unmap(cache);
+#endif
+    if (cache->fd != -1)
+    {
+        close(cache->fd);
+    }
+    free(cache);
+}
+
+int replay_cache_append(struct replay_cache *cache, const struct iovec *iov, int iovcnt)
+{
+    if (cache_open(cache) != 0)
+    {
+        return -1;
+    }
+
+#ifdef USE_AESD_CHAR_DEVICE
+    // Every write() is its own command to the driver, so each one is accounted for separately
+    for (int i = 0; i < iovcnt; ++i)
+    {
+        if (cache_write(cache, iov[i].iov_base, iov[i].iov_len) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+#else
+    return cache_writev(cache, iov, iovcnt);
+#endif
+}
+
+ssize_t replay_cache_pin(struct replay_cache *cache, struct output_queue *queue, size_t offset)
+{
+    if (cache_open(cache) != 0 || cache_sync(cache) != 0)
+    {
+        return -1;
+    }
+
+    if (offset >= cache->size)
+    {
+        return 0;
+    }
+    if (output_queue_admit(queue, cache->size - offset) != 0 || cache_pin(cache, queue, offset) != 0)
+    {
+        return -1;
+    }
+    return cache->size - offset;
+}
@@ -0,0 +1,213 @@
+/*
+ * aesdsocket-log.c
+ *
+ * Log messages are formatted by the thread logging them into a slot of a bounded lock free ring
+ * and handed to syslog() by a background thread, so connection threads never block on /dev/log.
+ * Writers claim slots with a compare and swap on the ring's write position, and each slot's
+ * sequence number tells the reader when it was filled and the writers when it was drained
+ * again.  A full ring drops the message rather than wait, the reader reports how many it lost.
+ *
+ * The reader sleeps on an eventfd while the ring is empty, and only the first message after it
+ * went to sleep pays for waking it up.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "aesdsocket.h"
+
+#define LOG_RING_SIZE 1024
+#define LOG_MESSAGE_SIZE 240
+
+struct log_record
+{
+    uint64_t sequence;
+    int priority;
+    char message[LOG_MESSAGE_SIZE];
+};
+
+int log_level = LOG_INFO;
+
+static struct log_record ring[LOG_RING_SIZE];
+static uint64_t write_position;
+// Only touched by the reader
+static uint64_t read_position;
+static uint64_t dropped;
+
+static int wakeup_fd = -1;
+static int reader_sleeping;
+static int reader_stopping;
+static bool reader_started;
+static pthread_t reader_thread;
+
+static void wake_reader(void)
+{
+    uint64_t one = 1;
+
+    // Only fails if the counter is about to overflow, in which case the reader is awake anyway
+    write(wakeup_fd, &one, sizeof(one));
+}
+
+void log_write(int priority, const char *format, ...)
+{
+    struct log_record *record;
+    uint64_t position;
+    va_list args;
+
+    if (!__atomic_load_n(&reader_started, __ATOMIC_ACQUIRE))
+    {
+        va_start(args, format);
+        vsyslog(priority, format, args);
+        va_end(args);
+        return;
+    }
+
+    position = __atomic_load_n(&write_position, __ATOMIC_RELAXED);
+    while (1)
+    {
+        int64_t distance;
+
+        record = &ring[position % LOG_RING_SIZE];
+        distance = (int64_t)(__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) - position);
+        if (distance == 0)
+        {
+            if (__atomic_compare_exchange_n(&write_position, &position, position + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (distance < 0)
+        {
+            // The reader hasn't drained this slot since the last lap
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+        {
+            position = __atomic_load_n(&write_position, __ATOMIC_RELAXED);
+        }
+    }
+
+    record->priority = priority;
+    va_start(args, format);
+    vsnprintf(record->message, sizeof(record->message), format, args);
+    va_end(args);
+    __atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
+
+    // Pairs with the fence in log_reader_func(), one of the two sees the other's store
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&reader_sleeping, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&reader_sleeping, 0, __ATOMIC_RELAXED))
+    {
+        wake_reader();
+    }
+}
+
+static bool record_ready(void)
+{
+    struct log_record *record = &ring[read_position % LOG_RING_SIZE];
+
+    return __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) == read_position + 1;
+}
+
+static void *log_reader_func(void *arg)
+{
+    uint64_t wakeups;
+
+    (void)arg;
+
+    while (1)
+    {
+        // Read before draining, so everything logged before log_stop() is drained
+        int stopping = __atomic_load_n(&reader_stopping, __ATOMIC_ACQUIRE);
+        uint64_t lost;
+
+        while (record_ready())
+        {
+            struct log_record *record = &ring[read_position % LOG_RING_SIZE];
+
+            syslog(record->priority, "%s", record->message);
+            __atomic_store_n(&record->sequence, read_position + LOG_RING_SIZE, __ATOMIC_RELEASE);
+            read_position++;
+        }
+
+        lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+        if (lost > 0)
+        {
+            syslog(LOG_WARNING, "Log ring full, dropped %llu messages", (unsigned long long)lost);
+        }
+
+        if (stopping)
+        {
+            break;
+        }
+
+        __atomic_store_n(&reader_sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (record_ready() || __atomic_load_n(&reader_stopping, __ATOMIC_ACQUIRE))
+        {
+            __atomic_store_n(&reader_sleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (read(wakeup_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EINTR)
+        {
+            syslog(LOG_ERR, "read(eventfd) failed: %s", strerror(errno));
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+int log_start(void)
+{
+    for (uint64_t i = 0; i < LOG_RING_SIZE; ++i)
+    {
+        ring[i].sequence = i;
+    }
+    write_position = 0;
+    read_position = 0;
+
+    wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (wakeup_fd == -1)
+    {
+        syslog(LOG_ERR, "eventfd failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (pthread_create(&reader_thread, NULL, log_reader_func, NULL) != 0)
+    {
+        syslog(LOG_ERR, "pthread_create log reader failed");
+        close(wakeup_fd);
+        wakeup_fd = -1;
+        return -1;
+    }
+
+    __atomic_store_n(&reader_started, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void log_stop(void)
+{
+    if (!reader_started)
+    {
+        return;
+    }
+
+    // The reader drains whatever is left in the ring before it exits
+    __atomic_store_n(&reader_stopping, 1, __ATOMIC_RELEASE);
+    wake_reader();
+    pthread_join(reader_thread, NULL);
+
+    __atomic_store_n(&reader_started, false, __ATOMIC_RELEASE);
+    close(wakeup_fd);
+    wakeup_fd = -1;
+}
@@ -0,0 +1,288 @@
+/*
+ * aesdsocket-metrics.c
+ *
+ * Counters and histograms updated with relaxed atomics from the connection paths, and a thread
+ * serving them in the Prometheus text format to whoever connects to the Unix socket given with
+ * -m, e.g. "socat - UNIX-CONNECT:/run/aesdsocket.metrics".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "aesdsocket.h"
+
+// Bucket i counts values up to 2^i, the last one everything larger
+#define HISTOGRAM_BUCKETS 32
+#define CACHE_LINE_SIZE 64
+
+/* Every counter on its own cache line, so acceptors updating different ones don't contend */
+struct metrics_counter_slot
+{
+    int64_t value;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct metrics_histogram_data
+{
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct metrics_description
+{
+    const char *name;
+    const char *type;
+    const char *help;
+};
+
+static const struct metrics_description counter_descriptions[METRICS_COUNTERS] =
+{
+    [METRIC_ACCEPTED] = { "aesdsocket_connections_accepted_total", "counter", "Connections accepted" },
+    [METRIC_ACTIVE] = { "aesdsocket_connections_active", "gauge", "Connections currently open" },
+    [METRIC_BYTES_IN] = { "aesdsocket_received_bytes_total", "counter", "Bytes received from clients" },
+    [METRIC_BYTES_OUT] = { "aesdsocket_sent_bytes_total", "counter", "Bytes sent to clients" },
+};
+
+static const struct metrics_description histogram_descriptions[METRICS_HISTOGRAMS] =
+{
+    [HISTOGRAM_CONNECTION_US] = { "aesdsocket_connection_duration_microseconds", "histogram",
+                                  "Time from accepting a connection to closing it" },
+    [HISTOGRAM_LOCK_WAIT_US] = { "aesdsocket_lock_wait_microseconds", "histogram",
+                                 "Time spent waiting for the data file mutex" },
+    [HISTOGRAM_REPLAY_BYTES] = { "aesdsocket_replay_bytes", "histogram",
+                                 "Size of the data file contents sent back per request" },
+};
+
+static struct metrics_counter_slot counters[METRICS_COUNTERS];
+static struct metrics_histogram_data histograms[METRICS_HISTOGRAMS];
+
+static int metrics_fd = -1;
+static char metrics_path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+static pthread_t metrics_thread;
+static bool metrics_thread_started;
+
+void metrics_add(enum metrics_counter counter, int64_t delta)
+{
+    __atomic_fetch_add(&counters[counter].value, delta, __ATOMIC_RELAXED);
+}
+
+static unsigned histogram_bucket(uint64_t value)
+{
+    unsigned bucket;
+
+    if (value <= 1)
+    {
+        return 0;
+    }
+    bucket = 64 - __builtin_clzll(value - 1);
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+void metrics_observe(enum metrics_histogram histogram, uint64_t value)
+{
+    struct metrics_histogram_data *data = &histograms[histogram];
+
+    __atomic_fetch_add(&data->buckets[histogram_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&data->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&data->sum, value, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/*
+ * Values are read one at a time, so a scrape racing with updates may see a histogram whose
+ * count is a few observations ahead of its buckets.  Good enough for monitoring.
+ */
+static void metrics_write(FILE *out)
+{
+    for (int i = 0; i < METRICS_COUNTERS; ++i)
+    {
+        const struct metrics_description *description = &counter_descriptions[i];
+
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n",
+                description->name, description->help, description->name, description->type,
+                description->name, (long long)__atomic_load_n(&counters[i].value, __ATOMIC_RELAXED));
+    }
+
+    for (int i = 0; i < METRICS_HISTOGRAMS; ++i)
+    {
+        const struct metrics_description *description = &histogram_descriptions[i];
+        uint64_t cumulative = 0;
+
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n",
+                description->name, description->help, description->name, description->type);
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket)
+        {
+            cumulative += __atomic_load_n(&histograms[i].buckets[bucket], __ATOMIC_RELAXED);
+            if (bucket < HISTOGRAM_BUCKETS - 1)
+            {
+                fprintf(out, "%s_bucket{le=\"%llu\"} %llu\n", description->name,
+                        1ULL << bucket, (unsigned long long)cumulative);
+            }
+            else
+            {
+                fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", description->name,
+                        (unsigned long long)cumulative);
+            }
+        }
+        fprintf(out, "%s_sum %llu\n%s_count %llu\n",
+                description->name, (unsigned long long)__atomic_load_n(&histograms[i].sum, __ATOMIC_RELAXED),
+                description->name, (unsigned long long)__atomic_load_n(&histograms[i].count, __ATOMIC_RELAXED));
+    }
+}
+
+/**
+ * Sends the current metrics to @param client_fd.  They're formatted into memory first and sent
+ * with MSG_NOSIGNAL, so a client hanging up early costs an EPIPE rather than a SIGPIPE.
+ */
+static void metrics_send(int client_fd)
+{
+    char *text = NULL;
+    size_t length = 0;
+    size_t sent = 0;
+    FILE *out = open_memstream(&text, &length);
+
+    if (out == NULL)
+    {
+        log_msg(LOG_ERR, "open_memstream failed: %s", strerror(errno));
+        return;
+    }
+    metrics_write(out);
+    if (fclose(out) != 0)
+    {
+        log_msg(LOG_ERR, "formatting metrics failed: %s", strerror(errno));
+        goto cleanup;
+    }
+
+    while (sent < length)
+    {
+        ssize_t ret = send(client_fd, text + sent, length - sent, MSG_NOSIGNAL);
+
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            log_msg(LOG_DEBUG, "sending metrics failed: %s", strerror(errno));
+            break;
+        }
+        sent += ret;
+    }
+
+cleanup:
+    free(text);
+}
+
+static void *metrics_thread_func(void *arg)
+{
+    (void)arg;
+
+    while (1)
+    {
+        int client_fd = accept(metrics_fd, NULL, NULL);
+
+        if (client_fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            // metrics_stop() shut the socket down
+            break;
+        }
+
+        metrics_send(client_fd);
+        close(client_fd);
+    }
+
+    return NULL;
+}
+
+int metrics_listen(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        log_msg(LOG_ERR, "metrics socket path %s is too long", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    metrics_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (metrics_fd == -1)
+    {
+        log_msg(LOG_ERR, "socket(AF_UNIX) failed: %s", strerror(errno));
+        return -1;
+    }
+
+    // A socket left behind by an earlier run would make bind() fail
+    unlink(path);
+    if (bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        log_msg(LOG_ERR, "bind(%s) failed: %s", path, strerror(errno));
+        goto error;
+    }
+    strcpy(metrics_path, path);
+
+    if (listen(metrics_fd, 4) == -1)
+    {
+        log_msg(LOG_ERR, "listen(%s) failed: %s", path, strerror(errno));
+        goto error;
+    }
+    return 0;
+
+error:
+    metrics_stop();
+    return -1;
+}
+
+int metrics_start(void)
+{
+    if (pthread_create(&metrics_thread, NULL, metrics_thread_func, NULL) != 0)
+    {
+        log_msg(LOG_ERR, "pthread_create metrics failed");
+        return -1;
+    }
+    metrics_thread_started = true;
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    if (metrics_fd == -1)
+    {
+        return;
+    }
+
+    if (metrics_thread_started)
+    {
+        // Fails the accept() the metrics thread is blocked in
+        shutdown(metrics_fd, SHUT_RDWR);
+        pthread_join(metrics_thread, NULL);
+        metrics_thread_started = false;
+    }
+
+    close(metrics_fd);
+    metrics_fd = -1;
+    if (metrics_path[0] != '\0')
+    {
+        unlink(metrics_path);
+        metrics_path[0] = '\0';
+    }
+}
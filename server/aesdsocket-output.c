@@ -0,0 +1,169 @@
+/*
+ * aesdsocket-output.c
+ *
+ * Per-connection output queues.  Replies are queued while the data file mutex is held, which only
+ * costs a reference to each block of the replay cache they lie in, and sent straight from those
+ * blocks after it was released, so a client that reads slowly only ever holds up its own
+ * connection.  Sends never block: when the socket buffer is full the thread waits in poll() for
+ * at most send_timeout_seconds before giving up on the client.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/socket.h>
+
+#include "aesdsocket.h"
+
+size_t max_output_bytes = DEFAULT_MAX_OUTPUT_BYTES;
+int send_timeout_seconds = DEFAULT_SEND_TIMEOUT_SECONDS;
+
+int output_queue_admit(struct output_queue *queue, size_t len)
+{
+    if (max_output_bytes != 0 && queue->length > 0 && queue->length + len > max_output_bytes)
+    {
+        log_msg(LOG_WARNING, "Reply of %zu bytes behind %zu unsent ones exceeds the %zu byte output limit",
+                len, queue->length, max_output_bytes);
+        return -1;
+    }
+    return 0;
+}
+
+int output_queue_push(struct output_queue *queue, struct replay_block *block, const char *data, size_t len)
+{
+    // sendmsg() would never consume an empty segment
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    if (queue->count == queue->capacity)
+    {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 16;
+        struct output_segment *segments = realloc(queue->segments, capacity * sizeof(*segments));
+
+        if (segments == NULL)
+        {
+            log_msg(LOG_ERR, "malloc failed");
+            return -1;
+        }
+        queue->segments = segments;
+        queue->capacity = capacity;
+    }
+
+    replay_block_get(block);
+    queue->segments[queue->count].block = block;
+    queue->segments[queue->count].data = data;
+    queue->segments[queue->count].len = len;
+    queue->count++;
+    queue->length += len;
+    return 0;
+}
+
+int output_queue_iov(struct output_queue *queue, struct iovec *iov, int max_iov, bool *more)
+{
+    size_t i = queue->first;
+    size_t offset = queue->offset;
+    int iovcnt = 0;
+
+    for (; i < queue->count && iovcnt < max_iov; ++i)
+    {
+        iov[iovcnt].iov_base = (char *)queue->segments[i].data + offset;
+        iov[iovcnt].iov_len = queue->segments[i].len - offset;
+        iovcnt++;
+        offset = 0;
+    }
+
+    *more = i < queue->count;
+    return iovcnt;
+}
+
+void output_queue_consume(struct output_queue *queue, size_t len)
+{
+    queue->length -= len;
+    while (len > 0)
+    {
+        struct output_segment *segment = &queue->segments[queue->first];
+        size_t left = segment->len - queue->offset;
+
+        if (len < left)
+        {
+            queue->offset += len;
+            return;
+        }
+
+        len -= left;
+        replay_block_put(segment->block);
+        queue->first++;
+        queue->offset = 0;
+    }
+
+    if (queue->first == queue->count)
+    {
+        queue->first = 0;
+        queue->count = 0;
+    }
+}
+
+void output_queue_clear(struct output_queue *queue)
+{
+    for (size_t i = queue->first; i < queue->count; ++i)
+    {
+        replay_block_put(queue->segments[i].block);
+    }
+    queue->first = 0;
+    queue->count = 0;
+    queue->offset = 0;
+    queue->length = 0;
+}
+
+/*
+ * Sends in batches of up to OUTPUT_MAX_IOVECS segments.  MSG_MORE on all but the last batch keeps
+ * the kernel from pushing out a short segment at every batch boundary.
+ */
+int output_queue_flush(struct output_queue *queue, int client_fd)
+{
+    struct iovec iov[OUTPUT_MAX_IOVECS];
+    struct msghdr msg = { .msg_iov = iov };
+    bool more;
+
+    while ((msg.msg_iovlen = output_queue_iov(queue, iov, OUTPUT_MAX_IOVECS, &more)) > 0)
+    {
+        struct pollfd pfd = { .fd = client_fd, .events = POLLOUT };
+        ssize_t bytes_sent = sendmsg(client_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        int ready;
+
+        if (bytes_sent >= 0)
+        {
+            output_queue_consume(queue, bytes_sent);
+            continue;
+        }
+
+        // EINTR too, connection threads are only interrupted once the drain deadline passed
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            log_msg(LOG_ERR, "sendmsg failed: %s", strerror(errno));
+            return -1;
+        }
+
+        ready = poll(&pfd, 1, send_timeout_seconds > 0 ? send_timeout_seconds * 1000 : -1);
+        if (ready == 0)
+        {
+            log_msg(LOG_WARNING, "Client read nothing for %d seconds, dropping it with %zu bytes unsent",
+                    send_timeout_seconds, queue->length);
+            return -1;
+        }
+        if (ready < 0)
+        {
+            if (errno != EINTR)
+            {
+                log_msg(LOG_ERR, "poll failed: %s", strerror(errno));
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * aesdsocket-slab.c
+ *
+ * Connection state comes from a slab: objects are carved out of blocks of SLAB_BLOCK_OBJECTS and
+ * go back on a free list when the connection ends, so a busy server stops calling malloc() and
+ * free() once it has seen its peak number of connections.  Recycled objects keep their contents,
+ * which lets a connection reuse the receive buffer grown by the one before it.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <syslog.h>
+
+#include "aesdsocket.h"
+
+#define SLAB_BLOCK_OBJECTS 32
+
+/* Precedes every block and every object, keeping what follows it suitably aligned */
+union slab_link
+{
+    union slab_link *next;
+    max_align_t align;
+};
+
+static size_t slab_slot_size(const struct slab *slab)
+{
+    size_t link_size = sizeof(union slab_link);
+
+    return link_size + (slab->object_size + link_size - 1) / link_size * link_size;
+}
+
+void slab_init(struct slab *slab, size_t object_size)
+{
+    slab->object_size = object_size;
+    slab->free_list = NULL;
+    slab->blocks = NULL;
+}
+
+void *slab_alloc(struct slab *slab)
+{
+    union slab_link *slot;
+
+    if (slab->free_list == NULL)
+    {
+        size_t slot_size = slab_slot_size(slab);
+        union slab_link *block = calloc(1, sizeof(*block) + SLAB_BLOCK_OBJECTS * slot_size);
+
+        if (block == NULL)
+        {
+            log_msg(LOG_ERR, "malloc failed");
+            return NULL;
+        }
+        block->next = slab->blocks;
+        slab->blocks = block;
+
+        for (int i = SLAB_BLOCK_OBJECTS - 1; i >= 0; --i)
+        {
+            slot = (union slab_link *)((char *)(block + 1) + i * slot_size);
+            slot->next = slab->free_list;
+            slab->free_list = slot;
+        }
+    }
+
+    slot = slab->free_list;
+    slab->free_list = slot->next;
+    return slot + 1;
+}
+
+void slab_free(struct slab *slab, void *object)
+{
+    union slab_link *slot = (union slab_link *)object - 1;
+
+    slot->next = slab->free_list;
+    slab->free_list = slot;
+}
+
+void slab_destroy(struct slab *slab, void (*release)(void *object))
+{
+    size_t slot_size = slab_slot_size(slab);
+
+    while (slab->blocks != NULL)
+    {
+        union slab_link *block = slab->blocks;
+
+        if (release != NULL)
+        {
+            for (int i = 0; i < SLAB_BLOCK_OBJECTS; ++i)
+            {
+                release((char *)(block + 1) + i * slot_size + sizeof(union slab_link));
+            }
+        }
+        slab->blocks = block->next;
+        free(block);
+    }
+    slab->free_list = NULL;
+}
+
+int buffer_reserve(char **buffer, size_t *capacity, size_t size)
+{
+    size_t new_capacity = *capacity ? *capacity : BUFFER_MIN_CAPACITY;
+    char *new_buffer;
+
+    if (size <= *capacity)
+    {
+        return 0;
+    }
+
+    while (new_capacity < size)
+    {
+        new_capacity *= 2;
+    }
+
+    new_buffer = realloc(*buffer, new_capacity);
+    if (new_buffer == NULL)
+    {
+        log_msg(LOG_ERR, "realloc failed");
+        return -1;
+    }
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+    return 0;
+}
+
+void buffer_recycle(char **buffer, size_t *capacity)
+{
+    if (*capacity > BUFFER_MAX_RETAINED)
+    {
+        free(*buffer);
+        *buffer = NULL;
+        *capacity = 0;
+    }
+}
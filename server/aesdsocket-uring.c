@@ -0,0 +1,810 @@
+/**
+ * @file aesdsocket-uring.c
+ * @brief io_uring backend for aesdsocket
+ *
+ * Serves every connection from a single thread.  Connections come from one multishot accept and
+ * packets are received into a pool of provided buffers, so a busy server makes one io_uring_enter
+ * per batch of requests instead of several syscalls each.  Appends and replays go through the data
+ * file mutex and the replay cache like the connection threads', the lock is only held for the
+ * append and for pinning the reply, which is then sent from the cache with IORING_OP_SENDMSG,
+ * linked to a timeout when -w is set.  The raw syscalls are used so there's no dependency on
+ * liburing.
+ */
+
+#ifdef USE_IO_URING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "queue.h"
+#include "aesdsocket.h"
+
+#define QUEUE_DEPTH 256
+#define RECV_BUFFER_SIZE 1024
+#define RECV_BUFFER_COUNT 64
+#define RECV_BUFFER_GROUP 0
+#define QUIESCE_TIMEOUT_NS 1000000000LL
+
+/*
+ * The operation a completion belongs to is kept in the low bits of its user_data,
+ * the rest is the struct uring_conn it belongs to (NULL for accept, provide buffers and timer)
+ */
+enum uring_op
+{
+    OP_ACCEPT,
+    OP_PROVIDE,
+    OP_RECV,
+    OP_SEND,
+    OP_SEND_TIMEOUT,
+    OP_TIMER,
+    OP_CANCEL,
+};
+#define OP_MASK 0x7ULL
+
+struct uring
+{
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+};
+
+/*
+ * Comes from conn_slab, packet and the output queue's segments are kept when it's recycled for
+ * the next connection
+ */
+struct uring_conn
+{
+    int socket_fd;
+    struct in_addr client_addr;
+    char *packet;
+    size_t packet_capacity;
+    size_t packet_size;
+    uint64_t accepted_us;
+    struct output_queue output;
+    // The IORING_OP_SENDMSG in flight sends from these
+    struct msghdr msg;
+    struct iovec iov[OUTPUT_MAX_IOVECS];
+    LIST_ENTRY(uring_conn) next;
+};
+
+// Per thread, so every acceptor started with -a runs its own ring
+static __thread struct uring ring;
+static __thread char *recv_buffers;
+static __thread bool multishot_accept = true;
+static __thread LIST_HEAD(uring_conn_list, uring_conn) conns;
+static __thread struct slab conn_slab;
+static __thread pthread_mutex_t *data_file_mutex;
+static __thread struct __kernel_timespec send_timeout;
+// Ring wide requests which found the SQ full, queued again by queue_deferred
+static __thread bool accept_deferred;
+static __thread bool timer_deferred;
+static __thread bool buffer_deferred[RECV_BUFFER_COUNT];
+static __thread unsigned deferred_buffers;
+// Receives and sends the kernel may still write to or send from, see uring_quiesce
+static __thread unsigned ops_in_flight;
+static __thread bool quiescing;
+
+static int uring_init(struct uring *r, unsigned entries)
+{
+    struct io_uring_params params = {0};
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (r->fd < 0)
+    {
+        return -1;
+    }
+
+    r->sq_entries = params.sq_entries;
+    r->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        r->sq_len = r->cq_len = r->sq_len > r->cq_len ? r->sq_len : r->cq_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+    {
+        close(r->fd);
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        r->cq_ptr = r->sq_ptr;
+    }
+    else
+    {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+        {
+            munmap(r->sq_ptr, r->sq_len);
+            close(r->fd);
+            return -1;
+        }
+    }
+
+    r->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+    {
+        if (r->cq_ptr != r->sq_ptr)
+        {
+            munmap(r->cq_ptr, r->cq_len);
+        }
+        munmap(r->sq_ptr, r->sq_len);
+        close(r->fd);
+        return -1;
+    }
+
+    r->sq_head = (unsigned *)((char *)r->sq_ptr + params.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ptr + params.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ptr + params.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ptr + params.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ptr + params.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ptr + params.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ptr + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_destroy(struct uring *r)
+{
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != r->sq_ptr)
+    {
+        munmap(r->cq_ptr, r->cq_len);
+    }
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+}
+
+/**
+ * Submits queued SQEs, waiting for at least @param wait_nr completions
+ */
+static int uring_enter(struct uring *r, unsigned wait_nr)
+{
+    unsigned to_submit = *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    return syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/**
+ * Like uring_enter, but gives up waiting after @param timeout_ns, failing with ETIME
+ */
+static int uring_enter_timeout(struct uring *r, unsigned wait_nr, long long timeout_ns)
+{
+    unsigned to_submit = *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ns / 1000000000LL,
+        .tv_nsec = timeout_ns % 1000000000LL,
+    };
+    struct io_uring_getevents_arg arg = {
+        .ts = (uint64_t)(uintptr_t)&ts,
+    };
+
+    return syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr,
+                   IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+/**
+ * Makes room for @param count more SQEs, submitting the queued ones if the SQ is full
+ * @return 0 on success, -1 if the kernel won't take the queued SQEs right now
+ */
+static int uring_reserve(struct uring *r, unsigned count)
+{
+    while (*r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) + count > r->sq_entries)
+    {
+        int ret = uring_enter(r, 0);
+
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        // EBUSY and EAGAIN mean completions must be reaped first, which only the event loop does
+        if (ret <= 0)
+        {
+            log_msg(LOG_ERR, "io_uring_enter failed: %s", ret < 0 ? strerror(errno) : "nothing submitted");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @return a zeroed SQE, already queued for the next uring_enter.  Nothing is submitted before
+ * then since there's no SQ polling thread, so callers can fill it in afterwards.  NULL if there's
+ * no room for it, see uring_reserve.
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *r, void *conn, enum uring_op op)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned index;
+    struct io_uring_sqe *sqe;
+
+    if (uring_reserve(r, 1) != 0)
+    {
+        return NULL;
+    }
+
+    index = tail & *r->sq_mask;
+    sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)(uintptr_t)conn | op;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static void queue_accept(int server_fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring, NULL, OP_ACCEPT);
+
+    accept_deferred = sqe == NULL;
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_fd;
+    if (multishot_accept)
+    {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+}
+
+static void queue_timer_poll(void)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring, NULL, OP_TIMER);
+
+    timer_deferred = sqe == NULL;
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = timestamp_timer_fd;
+    sqe->poll32_events = POLLIN;
+}
+
+static void queue_provide_buffers(unsigned first_bid, unsigned count)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring, NULL, OP_PROVIDE);
+
+    if (sqe == NULL)
+    {
+        for (unsigned bid = first_bid; bid < first_bid + count; bid++)
+        {
+            deferred_buffers += !buffer_deferred[bid];
+            buffer_deferred[bid] = true;
+        }
+        return;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uintptr_t)(recv_buffers + first_bid * RECV_BUFFER_SIZE);
+    sqe->len = RECV_BUFFER_SIZE;
+    sqe->off = first_bid;
+    sqe->buf_group = RECV_BUFFER_GROUP;
+}
+
+/**
+ * Queues whatever queue_accept, queue_timer_poll and queue_provide_buffers couldn't, called by the
+ * event loop once it reaped the completions that filled the SQ
+ */
+static void queue_deferred(int server_fd)
+{
+    if (accept_deferred && !exit_requested)
+    {
+        queue_accept(server_fd);
+    }
+    if (timer_deferred)
+    {
+        queue_timer_poll();
+    }
+    for (unsigned bid = 0; deferred_buffers > 0 && bid < RECV_BUFFER_COUNT; bid++)
+    {
+        if (buffer_deferred[bid])
+        {
+            buffer_deferred[bid] = false;
+            deferred_buffers--;
+            queue_provide_buffers(bid, 1);
+        }
+    }
+}
+
+/*
+ * The queue_ functions for a connection @return 0 on success, -1 if the SQ is full, in which case
+ * the caller closes the connection since nothing else is in flight for it
+ */
+static int queue_recv(struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring, conn, OP_RECV);
+
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->socket_fd;
+    sqe->len = RECV_BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BUFFER_GROUP;
+    ops_in_flight++;
+    return 0;
+}
+
+/**
+ * Queues a sendmsg() of the next batch of the connection's output queue, linked to a timeout
+ * when send_timeout_seconds is set.  The timeout cancels the send if the client doesn't read for
+ * that long, its own completion is ignored.
+ */
+static int queue_send(struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+    bool more;
+
+    // Both halves of the link or neither, a lone timeout would apply to whatever is queued next
+    if (uring_reserve(&ring, send_timeout_seconds > 0 ? 2 : 1) != 0)
+    {
+        return -1;
+    }
+
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = output_queue_iov(&conn->output, conn->iov, OUTPUT_MAX_IOVECS, &more);
+
+    sqe = uring_get_sqe(&ring, conn, OP_SEND);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->socket_fd;
+    sqe->addr = (uintptr_t)&conn->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    ops_in_flight++;
+    if (send_timeout_seconds == 0)
+    {
+        return 0;
+    }
+
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = uring_get_sqe(&ring, NULL, OP_SEND_TIMEOUT);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)&send_timeout;
+    sqe->len = 1;
+    return 0;
+}
+
+static void close_conn(struct uring_conn *conn)
+{
+    char client_ip[INET_ADDRSTRLEN];
+
+    close(conn->socket_fd);
+    if (log_connections)
+    {
+        inet_ntop(AF_INET, &conn->client_addr, client_ip, sizeof(client_ip));
+        log_msg(LOG_INFO, "Closed connection from %s", client_ip);
+    }
+    metrics_add(METRIC_ACTIVE, -1);
+    metrics_observe(HISTOGRAM_CONNECTION_US, metrics_now_us() - conn->accepted_us);
+
+    LIST_REMOVE(conn, next);
+    output_queue_clear(&conn->output);
+    buffer_recycle(&conn->packet, &conn->packet_capacity);
+    slab_free(&conn_slab, conn);
+}
+
+static void release_conn(void *object)
+{
+    struct uring_conn *conn = object;
+
+    free(conn->packet);
+    free(conn->output.segments);
+}
+
+/**
+ * Handles a complete packet: it's appended to the data file, or resolves a seek request, and the
+ * reply is queued under the data file mutex before being sent without it
+ */
+static void handle_packet(struct uring_conn *conn)
+{
+    bool staged;
+
+    if (conn->packet_size >= strlen(SEEKTO_MAGIC) && memcmp(conn->packet, SEEKTO_MAGIC, strlen(SEEKTO_MAGIC)) == 0)
+    {
+        staged = do_seek_to(data_file_mutex, conn->packet, &conn->output);
+    }
+    else
+    {
+        staged = append_and_stage(data_file_mutex, conn->packet, conn->packet_size, &conn->output);
+    }
+
+    if (!staged)
+    {
+        close_conn(conn);
+        return;
+    }
+
+    metrics_observe(HISTOGRAM_REPLAY_BYTES, conn->output.length);
+    if (conn->output.length == 0 || queue_send(conn) != 0)
+    {
+        close_conn(conn);
+    }
+}
+
+static void handle_accept(struct io_uring_cqe *cqe, int server_fd)
+{
+    struct uring_conn *conn;
+    struct sockaddr_in client_addr = {0};
+    socklen_t client_len = sizeof(client_addr);
+    char client_ip[INET_ADDRSTRLEN];
+
+    // Once exit was requested the listening socket is shut down, and accepting stops with it
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !exit_requested)
+    {
+        // Kernels without multishot accept reject it, fall back to re-arming after every connection
+        if (cqe->res == -EINVAL && multishot_accept)
+        {
+            multishot_accept = false;
+        }
+        queue_accept(server_fd);
+    }
+
+    if (cqe->res < 0)
+    {
+        if (cqe->res != -EINVAL)
+        {
+            log_msg(LOG_ERR, "accept() failed: %s", strerror(-cqe->res));
+        }
+        return;
+    }
+
+    metrics_add(METRIC_ACCEPTED, 1);
+    conn = slab_alloc(&conn_slab);
+    if (conn == NULL)
+    {
+        close(cqe->res);
+        return;
+    }
+    metrics_add(METRIC_ACTIVE, 1);
+    conn->accepted_us = metrics_now_us();
+
+    conn->socket_fd = cqe->res;
+    conn->packet_size = 0;
+    getpeername(conn->socket_fd, (struct sockaddr *)&client_addr, &client_len);
+    conn->client_addr = client_addr.sin_addr;
+    LIST_INSERT_HEAD(&conns, conn, next);
+
+    if (log_connections)
+    {
+        inet_ntop(AF_INET, &conn->client_addr, client_ip, sizeof(client_ip));
+        log_msg(LOG_INFO, "Accepted connection from %s", client_ip);
+    }
+    if (queue_recv(conn) != 0)
+    {
+        close_conn(conn);
+    }
+}
+
+static void handle_recv(struct uring_conn *conn, struct io_uring_cqe *cqe)
+{
+    unsigned bid;
+
+    if (cqe->res == -ENOBUFS)
+    {
+        // Every provided buffer is in flight, the ones being returned are queued ahead of this
+        if (queue_recv(conn) != 0)
+        {
+            close_conn(conn);
+        }
+        return;
+    }
+
+    if (cqe->res <= 0)
+    {
+        if (conn->packet_size > 0)
+        {
+            handle_packet(conn);
+        }
+        else
+        {
+            close_conn(conn);
+        }
+        return;
+    }
+
+    metrics_add(METRIC_BYTES_IN, cqe->res);
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (buffer_reserve(&conn->packet, &conn->packet_capacity, conn->packet_size + cqe->res + 1) != 0)
+    {
+        queue_provide_buffers(bid, 1);
+        close_conn(conn);
+        return;
+    }
+
+    memcpy(conn->packet + conn->packet_size, recv_buffers + bid * RECV_BUFFER_SIZE, cqe->res);
+    queue_provide_buffers(bid, 1);
+    conn->packet_size += cqe->res;
+    conn->packet[conn->packet_size] = '\0';
+
+    if (memchr(conn->packet + conn->packet_size - cqe->res, '\n', cqe->res) != NULL)
+    {
+        handle_packet(conn);
+    }
+    else if (queue_recv(conn) != 0)
+    {
+        close_conn(conn);
+    }
+}
+
+static void handle_send(struct uring_conn *conn, struct io_uring_cqe *cqe)
+{
+    if (cqe->res < 0)
+    {
+        if (cqe->res == -ECANCELED)
+        {
+            log_msg(LOG_WARNING, "Client read nothing for %d seconds, dropping it with %zu bytes unsent",
+                    send_timeout_seconds, conn->output.length);
+        }
+        close_conn(conn);
+        return;
+    }
+
+    metrics_add(METRIC_BYTES_OUT, cqe->res);
+    output_queue_consume(&conn->output, cqe->res);
+    if (conn->output.length > 0)
+    {
+        if (queue_send(conn) != 0)
+        {
+            close_conn(conn);
+        }
+        return;
+    }
+
+    close_conn(conn);
+}
+
+static void handle_cqe(struct io_uring_cqe *cqe, int server_fd)
+{
+    struct uring_conn *conn = (struct uring_conn *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+    enum uring_op op = cqe->user_data & OP_MASK;
+
+    if (op == OP_RECV || op == OP_SEND)
+    {
+        ops_in_flight--;
+    }
+    if (quiescing)
+    {
+        // Nothing new is started, a connection accepted in the meantime is just closed
+        if (op == OP_ACCEPT && cqe->res >= 0)
+        {
+            close(cqe->res);
+        }
+        return;
+    }
+
+    switch (op)
+    {
+    case OP_ACCEPT:
+        handle_accept(cqe, server_fd);
+        break;
+
+    case OP_PROVIDE:
+        if (cqe->res < 0)
+        {
+            log_msg(LOG_ERR, "providing receive buffers failed: %s", strerror(-cqe->res));
+        }
+        break;
+
+    case OP_RECV:
+        handle_recv(conn, cqe);
+        break;
+
+    case OP_SEND:
+        handle_send(conn, cqe);
+        break;
+
+    case OP_SEND_TIMEOUT:
+        // -ETIME when it fired, the send it was linked to completes with -ECANCELED
+        break;
+
+    case OP_TIMER:
+        timestamp_tick();
+        queue_timer_poll();
+        break;
+
+    case OP_CANCEL:
+        break;
+    }
+}
+
+static void uring_reap(int server_fd)
+{
+    unsigned head = *ring.cq_head;
+
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+    {
+        handle_cqe(&ring.cqes[head & *ring.cq_mask], server_fd);
+        head++;
+        // Release each slot as it's handled, handlers may flush the SQ while it's full
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Cancels everything still in flight and reaps the completions of the receives and sends, which
+ * point into recv_buffers and the connections' pinned replay blocks.  The connections are shut
+ * down as well, which completes their requests on kernels where cancelling one doesn't.
+ * @return 0 once none are left, -1 if some didn't complete within QUIESCE_TIMEOUT_NS
+ */
+static int uring_quiesce(int server_fd)
+{
+    struct uring_conn *conn;
+    struct io_uring_sqe *sqe;
+    struct timespec now;
+    long long deadline_ns;
+
+    quiescing = true;
+    LIST_FOREACH(conn, &conns, next)
+    {
+        shutdown(conn->socket_fd, SHUT_RDWR);
+    }
+    sqe = uring_get_sqe(&ring, NULL, OP_CANCEL);
+    if (sqe != NULL)
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    deadline_ns = now.tv_sec * 1000000000LL + now.tv_nsec + QUIESCE_TIMEOUT_NS;
+    while (ops_in_flight > 0)
+    {
+        long long timeout_ns;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timeout_ns = deadline_ns - (now.tv_sec * 1000000000LL + now.tv_nsec);
+        if (timeout_ns <= 0)
+        {
+            return -1;
+        }
+        if (uring_enter_timeout(&ring, 1, timeout_ns) < 0 && errno != EINTR && errno != ETIME)
+        {
+            log_msg(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            return -1;
+        }
+        uring_reap(server_fd);
+    }
+    return 0;
+}
+
+int uring_server_run(int server_fd, pthread_mutex_t *mutex)
+{
+    int retval;
+    int result = 0;
+    bool draining = false;
+    long long deadline_ns = 0;
+    struct timespec now;
+
+    if (uring_init(&ring, QUEUE_DEPTH) != 0)
+    {
+        return -1;
+    }
+
+    recv_buffers = malloc(RECV_BUFFER_COUNT * RECV_BUFFER_SIZE);
+    if (recv_buffers == NULL)
+    {
+        log_msg(LOG_ERR, "malloc failed");
+        uring_destroy(&ring);
+        return -1;
+    }
+
+    data_file_mutex = mutex;
+    send_timeout.tv_sec = send_timeout_seconds;
+
+    LIST_INIT(&conns);
+    slab_init(&conn_slab, sizeof(struct uring_conn));
+    queue_provide_buffers(0, RECV_BUFFER_COUNT);
+    queue_accept(server_fd);
+    if (timestamp_timer_fd != -1)
+    {
+        queue_timer_poll();
+    }
+
+    log_msg(LOG_INFO, "Serving connections with io_uring");
+
+    while (1)
+    {
+        queue_deferred(server_fd);
+        if (exit_requested && !draining)
+        {
+            // Stop accepting and give the connections in flight until the deadline to finish
+            draining = true;
+            shutdown(server_fd, SHUT_RD);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            deadline_ns = now.tv_sec * 1000000000LL + now.tv_nsec + drain_timeout_seconds * 1000000000LL;
+        }
+
+        if (draining)
+        {
+            long long timeout_ns;
+
+            if (LIST_EMPTY(&conns))
+            {
+                break;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timeout_ns = deadline_ns - (now.tv_sec * 1000000000LL + now.tv_nsec);
+            if (timeout_ns <= 0)
+            {
+                log_msg(LOG_WARNING, "Drain deadline passed, dropping the remaining connections");
+                break;
+            }
+            retval = uring_enter_timeout(&ring, 1, timeout_ns);
+        }
+        else
+        {
+            retval = uring_enter(&ring, 1);
+        }
+
+        if (retval < 0)
+        {
+            if (errno == EINTR || errno == ETIME)
+            {
+                continue;
+            }
+            log_msg(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            result = -1;
+            break;
+        }
+
+        uring_reap(server_fd);
+    }
+
+    if (uring_quiesce(server_fd) != 0)
+    {
+        // Freeing them could hand the kernel's writes and sends memory that's in use again
+        log_msg(LOG_ERR, "%u io_uring requests didn't complete, leaking their buffers", ops_in_flight);
+        uring_destroy(&ring);
+        return -1;
+    }
+    uring_destroy(&ring);
+    while (!LIST_EMPTY(&conns))
+    {
+        close_conn(LIST_FIRST(&conns));
+    }
+    slab_destroy(&conn_slab, release_conn);
+    free(recv_buffers);
+    return result;
+}
+
+#endif /* USE_IO_URING */
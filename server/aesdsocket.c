@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,51 +15,124 @@
 #include <sys/stat.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 
 #include "queue.h"
+#include "aesdsocket.h"
 #include "../aesd-char-driver/aesd_ioctl.h"
 
-#ifdef USE_AESD_CHAR_DEVICE
-    #define DATA_FILE "/dev/aesdchar"
-#else
-    #define DATA_FILE "/var/tmp/aesdsocketdata"
-#endif
+#define DEFAULT_BACKLOG 10
+#define TIMESTAMP_INTERVAL_SECONDS 10
+#define DEFAULT_DRAIN_SECONDS 5
+#define DRAIN_POLL_MS 10
+#define RECV_SIZE 1024
 
-#define SEEKTO_MAGIC "AESDCHAR_IOCSEEKTO:"
+struct acceptor;
 
+/**
+ * State of one connection thread.  Comes from its acceptor's slab and is recycled once the
+ * thread was joined, receive buffer included.
+ */
 struct thread_data
 {
     pthread_t thread_id;
     int socket_fd;
     struct in_addr client_addr;
     pthread_mutex_t *data_file_mutex;
-    SLIST_ENTRY(thread_data) next;
+    struct acceptor *acceptor;
+    LIST_ENTRY(thread_data) next;
+    // Link in the acceptor's completion queue
+    struct thread_data *next_finished;
+    char *packet;
+    size_t packet_capacity;
+    struct output_queue output;
+    uint64_t accepted_us;
 
     bool success;
-    bool is_finished;
 };
 
-static int exit_requested = 0;
-static SLIST_HEAD(thread_list_head, thread_data) threads;
+LIST_HEAD(thread_list_head, thread_data);
+
+/**
+ * One listening socket and the thread accepting on it. With -a N there are N of these,
+ * each bound to port 9000 with SO_REUSEPORT so the kernel spreads new connections across them.
+ */
+struct acceptor
+{
+    pthread_t thread_id;
+    int server_fd;
+    int cpu;                // -1 when it's the only one and isn't pinned
+    bool use_io_uring;
+    pthread_mutex_t *data_file_mutex;
+    struct thread_list_head threads;
+    // Connection threads waiting to be joined, each pushes itself as its last step
+    struct thread_data *finished;
+    struct slab thread_slab;
+    int retval;
+};
+
+volatile sig_atomic_t exit_requested = 0;
+int drain_timeout_seconds = DEFAULT_DRAIN_SECONDS;
+bool log_connections = true;
+// Guarded by the data file mutex, like DATA_FILE itself
+static struct replay_cache *replay_cache;
+
+int timestamp_timer_fd = -1;
+#ifndef USE_AESD_CHAR_DEVICE
+static pthread_mutex_t *timestamp_mutex;
+#endif
+// Set by timestamp_tick(), cleared by whoever appends the timestamp record
+static int timestamp_due;
 
 void signal_handler(int signo) {
     (void)signo;
 
-    syslog(LOG_INFO, "Caught signal, exiting");
+    log_msg(LOG_INFO, "Caught signal, exiting");
     exit_requested = 1;
 }
 
+/*
+ * Only used to interrupt a blocked accept() or io_uring_enter() in an acceptor thread, and a
+ * connection thread still running when the drain deadline passes
+ */
+static void wakeup_handler(int signo) {
+    (void)signo;
+}
+
+/**
+ * Blocks SIGINT and SIGTERM in the calling thread, threads it creates inherit the mask
+ */
+static void block_exit_signals(sigset_t *old_mask)
+{
+    sigset_t exit_signals;
+
+    sigemptyset(&exit_signals);
+    sigaddset(&exit_signals, SIGINT);
+    sigaddset(&exit_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &exit_signals, old_mask);
+}
+
 void setup_signal_handling() {
     struct sigaction sa = {0};
     sa.sa_handler = signal_handler;
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+
+    sa.sa_handler = wakeup_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    // Sends already pass MSG_NOSIGNAL, this covers any write to a socket the peer has closed
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
 }
 
 void daemonize() {
     pid_t pid = fork();
     if (pid < 0) {
-        syslog(LOG_ERR, "Fork failed: %s", strerror(errno));
+        log_msg(LOG_ERR, "Fork failed: %s", strerror(errno));
         exit(-1);
     }
     if (pid > 0) {
@@ -66,14 +140,14 @@ void daemonize() {
     }
 
     if (setsid() == -1) {
-        syslog(LOG_ERR, "setsid failed: %s", strerror(errno));
+        log_msg(LOG_ERR, "setsid failed: %s", strerror(errno));
         exit(-1);
     }
 
     int fd = open("/dev/null", O_RDWR);
     if (fd == -1)
     {
-        syslog(LOG_ERR, "failed opening /dev/null: %s", strerror(errno));
+        log_msg(LOG_ERR, "failed opening /dev/null: %s", strerror(errno));
         exit(-1);
     }
 
@@ -83,229 +157,580 @@ void daemonize() {
     close(fd);
 }
 
-static void do_seek_to(struct thread_data *data, char* packet)
+/**
+ * Formats the timestamp record appended to DATA_FILE into @param line.  tzset() runs once at
+ * startup, so localtime_r() doesn't look the timezone up again for every record.
+ * @return the length of the record, or -1 on error
+ */
+static int format_timestamp(char *line, size_t size)
 {
-    int client_fd = data->socket_fd;
-    FILE *data_file = NULL;
+    time_t now = time(NULL);
+    struct tm tm_info;
+    char time_str[128];
+
+    if (localtime_r(&now, &tm_info) == NULL) {
+        log_msg(LOG_ERR, "localtime_r failed");
+        return -1;
+    }
+
+    if (strftime(time_str, sizeof(time_str), "%a, %d %b %Y %H:%M:%S %z", &tm_info) == 0) {
+        log_msg(LOG_ERR, "strftime returned 0");
+        return -1;
+    }
+
+    return snprintf(line, size, "timestamp:%s\n", time_str);
+}
+
+/**
+ * Appends @param len bytes at @param data to DATA_FILE, preceded by the timestamp record if one
+ * came due, so both go out in the same write.  The data file mutex must be held.
+ */
+static int append_to_data_file(const char *data, size_t len)
+{
+    char line[160];
+    struct iovec iov[2];
+    int iovcnt = 0;
+
+    if (__atomic_exchange_n(&timestamp_due, 0, __ATOMIC_ACQ_REL)) {
+        int line_len = format_timestamp(line, sizeof(line));
+
+        if (line_len > 0) {
+            iov[iovcnt].iov_base = line;
+            iov[iovcnt].iov_len = line_len;
+            iovcnt++;
+        }
+    }
+
+    if (len > 0) {
+        iov[iovcnt].iov_base = (void *)data;
+        iov[iovcnt].iov_len = len;
+        iovcnt++;
+    }
+
+    if (iovcnt == 0) {
+        return 0;
+    }
+    return replay_cache_append(replay_cache, iov, iovcnt);
+}
+
+/**
+ * Unlocks the data file mutex, appending a timestamp which came due while it was held first.
+ * timestamp_tick() only tries the lock, so whoever holds it writes the timestamp instead.
+ */
+static int unlock_data_file(pthread_mutex_t *data_file_mutex)
+{
+    while (1)
+    {
+        if (__atomic_load_n(&timestamp_due, __ATOMIC_ACQUIRE) && append_to_data_file(NULL, 0) != 0)
+        {
+            log_msg(LOG_ERR, "appending timestamp to %s failed", DATA_FILE);
+        }
+
+        if (pthread_mutex_unlock(data_file_mutex) != 0)
+        {
+            return -1;
+        }
+
+        // Catches a tick which found the mutex still taken after the check above
+        if (!__atomic_load_n(&timestamp_due, __ATOMIC_ACQUIRE) || pthread_mutex_trylock(data_file_mutex) != 0)
+        {
+            return 0;
+        }
+    }
+}
+
+/*
+ * There's no timer in the char device build, so nothing calls it there
+ */
+void timestamp_tick(void)
+{
+#ifndef USE_AESD_CHAR_DEVICE
+    uint64_t expirations;
+
+    // Every acceptor polls the timer, only the one whose read succeeds handles the expiry
+    if (read(timestamp_timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    {
+        return;
+    }
+
+    log_msg(LOG_DEBUG, "timestamp due");
+    __atomic_store_n(&timestamp_due, 1, __ATOMIC_RELEASE);
+    if (pthread_mutex_trylock(timestamp_mutex) == 0)
+    {
+        unlock_data_file(timestamp_mutex);
+    }
+#endif
+}
+
+#ifndef USE_AESD_CHAR_DEVICE
+/**
+ * Arms timestamp_timer_fd to expire right away and then every TIMESTAMP_INTERVAL_SECONDS
+ */
+static int timestamp_timer_start(pthread_mutex_t *data_file_mutex)
+{
+    struct itimerspec interval = {0};
+
+    tzset();
+    timestamp_mutex = data_file_mutex;
+
+    timestamp_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timestamp_timer_fd == -1)
+    {
+        log_msg(LOG_ERR, "timerfd_create failed: %s", strerror(errno));
+        return -1;
+    }
+
+    interval.it_value.tv_nsec = 1;
+    interval.it_interval.tv_sec = TIMESTAMP_INTERVAL_SECONDS;
+    if (timerfd_settime(timestamp_timer_fd, 0, &interval, NULL) != 0)
+    {
+        log_msg(LOG_ERR, "timerfd_settime failed: %s", strerror(errno));
+        close(timestamp_timer_fd);
+        timestamp_timer_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/**
+ * Locks the data file mutex, recording how long it took in the lock wait histogram.  The clock
+ * is only read when the mutex is contended.
+ */
+static int lock_data_file(pthread_mutex_t *data_file_mutex)
+{
+    uint64_t start_us;
+    int retval;
+
+    if (pthread_mutex_trylock(data_file_mutex) == 0)
+    {
+        metrics_observe(HISTOGRAM_LOCK_WAIT_US, 0);
+        return 0;
+    }
+
+    start_us = metrics_now_us();
+    retval = pthread_mutex_lock(data_file_mutex);
+    metrics_observe(HISTOGRAM_LOCK_WAIT_US, metrics_now_us() - start_us);
+    return retval;
+}
+
+bool do_seek_to(pthread_mutex_t *data_file_mutex, const char *packet, struct output_queue *output)
+{
+    int fd = -1;
     bool success = false;
     struct aesd_seekto seekto = {0};
-    char buffer[1024];
-    ssize_t bytes_read;
+    off_t replay_pos;
 
-    if (pthread_mutex_lock(data->data_file_mutex) != 0)
+    if (lock_data_file(data_file_mutex) != 0)
     {
-        syslog(LOG_ERR, "lock failed");
-        goto cleanup;
+        log_msg(LOG_ERR, "lock failed");
+        return false;
     }
 
     if (sscanf(packet, SEEKTO_MAGIC "%u,%u", &seekto.write_cmd, &seekto.write_cmd_offset) != 2)
     {
-        syslog(LOG_ERR, "Invalid seekto packet: %s", packet);
+        log_msg(LOG_ERR, "Invalid seekto packet: %s", packet);
         goto cleanup;
     }
 
-    data_file = fopen(DATA_FILE, "r+");
-    if (!data_file) {
-        syslog(LOG_ERR, "fopen(%s, r+) failed: %s", DATA_FILE, strerror(errno));
+    fd = open(DATA_FILE, O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        log_msg(LOG_ERR, "open(%s) failed: %s", DATA_FILE, strerror(errno));
         goto cleanup;
     }
 
-    if (ioctl(fileno(data_file), AESDCHAR_IOCSEEKTO, &seekto) != 0)
+    if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) != 0)
     {
-        syslog(LOG_ERR, "ioctl_seekto(%u, %u) failed : %s", seekto.write_cmd, seekto.write_cmd_offset, strerror(errno));
+        log_msg(LOG_ERR, "ioctl_seekto(%u, %u) failed : %s", seekto.write_cmd, seekto.write_cmd_offset, strerror(errno));
         goto cleanup;
     }
 
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), data_file)) > 0) {
-        send(client_fd, buffer, bytes_read, 0);
+    // The replay starts where the ioctl left the file position, and comes from the cache like any other
+    replay_pos = lseek(fd, 0, SEEK_CUR);
+    if (replay_pos < 0)
+    {
+        log_msg(LOG_ERR, "lseek(%s) failed: %s", DATA_FILE, strerror(errno));
+        goto cleanup;
     }
 
-    success = true;
+    success = replay_cache_pin(replay_cache, output, replay_pos) >= 0;
 
 cleanup:
-    if (data_file != NULL)
+    if (fd != -1)
     {
-        fclose(data_file);
+        close(fd);
+    }
+    if (unlock_data_file(data_file_mutex) != 0)
+    {
+        log_msg(LOG_ERR, "unlock failed");
+        return false;
     }
-    pthread_mutex_unlock(data->data_file_mutex);
-    free(packet);
 
-    close(client_fd);
-    syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(data->client_addr));
+    return success;
+}
 
-    data->success = success;
-    data->is_finished = true;
+bool append_and_stage(pthread_mutex_t *data_file_mutex, const char *packet, size_t packet_size,
+                      struct output_queue *output)
+{
+    bool success;
+
+    if (lock_data_file(data_file_mutex) != 0)
+    {
+        log_msg(LOG_ERR, "lock failed");
+        return false;
+    }
+
+    success = append_to_data_file(packet, packet_size) == 0 &&
+              replay_cache_pin(replay_cache, output, 0) >= 0;
+
+    if (unlock_data_file(data_file_mutex) != 0)
+    {
+        log_msg(LOG_ERR, "unlock failed");
+        return false;
+    }
+
+    return success;
+}
+
+/**
+ * Queues @param data for its acceptor to join, the last thing a connection thread does
+ */
+static void thread_finished(struct thread_data *data)
+{
+    struct acceptor *acceptor = data->acceptor;
+    struct thread_data *head = __atomic_load_n(&acceptor->finished, __ATOMIC_RELAXED);
+
+    do {
+        data->next_finished = head;
+    } while (!__atomic_compare_exchange_n(&acceptor->finished, &head, data, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
 void* thread_func(void *arg)
 {
     struct thread_data *data = (struct thread_data *)arg;
     int client_fd = data->socket_fd;
-    char *packet = NULL;
     size_t packet_size = 0;
-    char buffer[1024];
     ssize_t bytes_received;
-    ssize_t bytes_read;
-    FILE *data_file = NULL;
+    size_t replay_size;
+    bool staged;
     bool success = false;
+    char client_ip[INET_ADDRSTRLEN] = "";
 
-    syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(data->client_addr));
+    if (log_connections) {
+        inet_ntop(AF_INET, &data->client_addr, client_ip, sizeof(client_ip));
+        log_msg(LOG_INFO, "Accepted connection from %s", client_ip);
+    }
 
     while (1)
     {
-        bytes_received = recv(client_fd, buffer, sizeof(buffer), 0);
-        if (bytes_received <= 0) {
-            break;
+        // Room for at least RECV_SIZE more bytes and a terminating NUL, sscanf relies on it
+        if (buffer_reserve(&data->packet, &data->packet_capacity, packet_size + RECV_SIZE + 1) != 0) {
+            goto cleanup;
         }
 
-        packet = realloc(packet, packet_size + bytes_received + 1);
-        if (!packet) {
-            syslog(LOG_ERR, "realloc failed");
+        bytes_received = recv(client_fd, data->packet + packet_size, data->packet_capacity - packet_size - 1, 0);
+        if (bytes_received < 0 && errno == EINTR) {
+            // Interrupted by drain_threads(), the packet was never acknowledged so it's dropped
+            inet_ntop(AF_INET, &data->client_addr, client_ip, sizeof(client_ip));
+            log_msg(LOG_INFO, "Dropping unfinished packet from %s", client_ip);
             goto cleanup;
         }
+        if (bytes_received <= 0) {
+            break;
+        }
 
-        memcpy(packet + packet_size, buffer, bytes_received);
+        metrics_add(METRIC_BYTES_IN, bytes_received);
         packet_size += bytes_received;
-        packet[packet_size] = '\0';
+        data->packet[packet_size] = '\0';
 
-        if (strchr(packet, '\n')) {
+        if (memchr(data->packet + packet_size - bytes_received, '\n', bytes_received)) {
             break;
         }
     }
 
-    if (memcmp(packet, SEEKTO_MAGIC, strlen(SEEKTO_MAGIC)) == 0)
+    if (packet_size == 0)
     {
-        do_seek_to(data, packet);
-        return NULL;
+        goto cleanup;
     }
 
-    if (pthread_mutex_lock(data->data_file_mutex) != 0)
+    if (packet_size >= strlen(SEEKTO_MAGIC) && memcmp(data->packet, SEEKTO_MAGIC, strlen(SEEKTO_MAGIC)) == 0)
     {
-        syslog(LOG_ERR, "lock failed");
-        goto cleanup;
+        staged = do_seek_to(data->data_file_mutex, data->packet, &data->output);
     }
-    
-    data_file = fopen(DATA_FILE, "a");
-    if (!data_file) {
-        syslog(LOG_ERR, "fopen() for appending to %s failed: %s", DATA_FILE, strerror(errno));
-        pthread_mutex_unlock(data->data_file_mutex);
-        goto cleanup;
+    else
+    {
+        staged = append_and_stage(data->data_file_mutex, data->packet, packet_size, &data->output);
     }
-    fwrite(packet, 1, packet_size, data_file);
-    fflush(data_file);
 
-    free(packet);
-    fclose(data_file);
-    data_file = NULL;
-
-    data_file = fopen(DATA_FILE, "r");
-    if (data_file == NULL)
+    if (!staged)
     {
-        syslog(LOG_ERR, "fopen for reading %s failed: %s", DATA_FILE, strerror(errno));
-        pthread_mutex_unlock(data->data_file_mutex);
         goto cleanup;
     }
 
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), data_file)) > 0) {
-        send(client_fd, buffer, bytes_read, 0);
-    }
-
-    fclose(data_file);
-    data_file = NULL;
-
-    if (pthread_mutex_unlock(data->data_file_mutex) != 0)
+    // The data file mutex is released by now, a slow client only holds up this thread
+    replay_size = data->output.length;
+    if (output_queue_flush(&data->output, client_fd) != 0)
     {
-        syslog(LOG_ERR, "unlock failed");
         goto cleanup;
     }
+    metrics_add(METRIC_BYTES_OUT, replay_size);
+    metrics_observe(HISTOGRAM_REPLAY_BYTES, replay_size);
 
     success = true;
 
 cleanup:
-    if (data_file != NULL)
-    {
-        fclose(data_file);
-    }
+    // Releases whatever a failed send left pinned
+    output_queue_clear(&data->output);
     close(client_fd);
-    syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(data->client_addr));
+    if (log_connections) {
+        log_msg(LOG_INFO, "Closed connection from %s", client_ip);
+    }
+    metrics_add(METRIC_ACTIVE, -1);
+    metrics_observe(HISTOGRAM_CONNECTION_US, metrics_now_us() - data->accepted_us);
 
     data->success = success;
-    data->is_finished = true;
+    thread_finished(data);
 
     return NULL;
 }
 
-void* timestamp_thread_func(void *arg)
+/**
+ * Joins the connection threads on the acceptor's completion queue and recycles their state.
+ * With @param interrupt set, the ones still running get a SIGUSR1 to make them give up on
+ * their client.
+ * @return 0 on success, -1 if a thread couldn't be joined
+ */
+static int reap_threads(struct acceptor *acceptor, bool interrupt)
 {
-    pthread_mutex_t *data_file_mutex = (pthread_mutex_t *)arg;
+    struct thread_data *current = __atomic_exchange_n(&acceptor->finished, NULL, __ATOMIC_ACQUIRE);
+    struct thread_data *next_finished;
+    int retval = 0;
 
-    while (1) {
-        time_t now = time(NULL);
-        struct tm *tm_info = localtime(&now);
+    for (; current != NULL; current = next_finished)
+    {
+        next_finished = current->next_finished;
+        if (log_connections)
+        {
+            log_msg(LOG_INFO, "Thread %ld finished with %s", current->thread_id, current->success ? "success" : "failure");
+        }
+        LIST_REMOVE(current, next);
 
-        if (!tm_info) {
-            syslog(LOG_ERR,"localtime failed");
-            exit(-1);
+        if (pthread_join(current->thread_id, NULL) != 0)
+        {
+            log_msg(LOG_ERR, "pthread_join failed");
+            retval = -1;
+            continue;
         }
 
-        char time_str[128];
+        buffer_recycle(&current->packet, &current->packet_capacity);
+        slab_free(&acceptor->thread_slab, current);
+    }
 
-        if (strftime(time_str, sizeof(time_str), "%a, %d %b %Y %H:%M:%S %z", tm_info) == 0) {
-            syslog(LOG_ERR, "strftime returned 0");
-            exit(-1);
+    if (interrupt)
+    {
+        LIST_FOREACH(current, &acceptor->threads, next)
+        {
+            pthread_kill(current->thread_id, SIGUSR1);
         }
+    }
+
+    return retval;
+}
 
-        syslog(LOG_DEBUG, "timestamp thread: locking and writng timestamp %s", time_str);
+static void release_thread_data(void *object)
+{
+    struct thread_data *data = object;
+
+    free(data->packet);
+    free(data->output.segments);
+}
+
+/**
+ * Waits up to drain_timeout_seconds for the connections in flight to finish, then interrupts
+ * whatever is left and joins every connection thread.
+ */
+static int drain_threads(struct acceptor *acceptor)
+{
+    struct timespec deadline;
+    struct timespec now;
+    struct timespec poll_interval = { .tv_sec = 0, .tv_nsec = DRAIN_POLL_MS * 1000000L };
+    bool expired = false;
 
-        if (pthread_mutex_lock(data_file_mutex) != 0)
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += drain_timeout_seconds;
+
+    while (1)
+    {
+        if (reap_threads(acceptor, expired) != 0)
         {
-            syslog(LOG_ERR, "lock failed in timestamp thread");
-            exit(-1);
+            return -1;
         }
-
-        FILE *data_file = fopen(DATA_FILE, "a");
-        if (data_file == NULL) {
-            syslog(LOG_ERR,"fopen %s failed in timestamp thread", DATA_FILE);
-            exit(-1);
+        if (LIST_EMPTY(&acceptor->threads))
+        {
+            slab_destroy(&acceptor->thread_slab, release_thread_data);
+            return 0;
         }
 
-        fprintf(data_file, "timestamp:%s\n", time_str);
-        fflush(data_file);
-        fclose(data_file);
-
-        if (pthread_mutex_unlock(data_file_mutex) != 0)
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!expired && (now.tv_sec > deadline.tv_sec ||
+                         (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)))
         {
-            syslog(LOG_ERR, "unlock failed in timestamp thread");
-            exit(-1);
+            log_msg(LOG_WARNING, "Drain deadline passed, dropping the remaining connections");
+            expired = true;
         }
 
-        sleep(10);
+        nanosleep(&poll_interval, NULL);
     }
-
-    return NULL;
 }
 
-int main(int argc, char *argv[]) {
-    int server_fd = -1;
+/**
+ * Accepts connections on the acceptor's socket and serves each one on its own thread
+ * until exit is requested.
+ */
+static int thread_server_run(struct acceptor *acceptor)
+{
     int client_fd = -1;
-    struct sockaddr_in server_addr, client_addr;
+    struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
-    pthread_mutex_t data_file_mutex = {0};
     struct thread_data *thread_data = NULL;
+    sigset_t old_mask;
+    int retval;
 
-    SLIST_FIRST(&threads) = NULL;
-    openlog("aesdsocket", LOG_PID, LOG_USER);
-    setup_signal_handling();
-    pthread_mutex_init(&data_file_mutex, NULL);
+    LIST_INIT(&acceptor->threads);
+    acceptor->finished = NULL;
+    slab_init(&acceptor->thread_slab, sizeof(struct thread_data));
+
+    while (!exit_requested) {
+        if (timestamp_timer_fd != -1) {
+            struct pollfd fds[2] = {
+                { .fd = acceptor->server_fd, .events = POLLIN },
+                { .fd = timestamp_timer_fd, .events = POLLIN },
+            };
+
+            if (poll(fds, 2, -1) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                log_msg(LOG_ERR, "poll() failed: %s", strerror(errno));
+                return -1;
+            }
+            if (fds[1].revents & POLLIN) {
+                timestamp_tick();
+            }
+            if (fds[0].revents == 0) {
+                continue;
+            }
+        }
+
+        client_fd = accept(acceptor->server_fd, (struct sockaddr *)&client_addr, &client_len);
+        if (client_fd == -1) {
+            if (errno == EINTR || exit_requested)
+            {
+                continue;
+            }
+            log_msg(LOG_ERR, "accept() failed: %s", strerror(errno));
+            return -1;
+        }
+
+        metrics_add(METRIC_ACCEPTED, 1);
+        metrics_add(METRIC_ACTIVE, 1);
+
+        thread_data = slab_alloc(&acceptor->thread_slab);
+        if (thread_data == NULL)
+        {
+            close(client_fd);
+            metrics_add(METRIC_ACTIVE, -1);
+            return -1;
+        }
+
+        thread_data->socket_fd = client_fd;
+        thread_data->client_addr = client_addr.sin_addr;
+        thread_data->data_file_mutex = acceptor->data_file_mutex;
+        thread_data->acceptor = acceptor;
+        thread_data->accepted_us = metrics_now_us();
+        thread_data->success = false;
+        LIST_INSERT_HEAD(&acceptor->threads, thread_data, next);
+
+        // SIGINT and SIGTERM are for the acceptors, a connection thread is only ever interrupted by drain_threads()
+        block_exit_signals(&old_mask);
+        retval = pthread_create(&thread_data->thread_id, NULL, thread_func, thread_data);
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        if (retval != 0)
+        {
+            log_msg(LOG_ERR, "pthread_create failed");
+            LIST_REMOVE(thread_data, next);
+            slab_free(&acceptor->thread_slab, thread_data);
+            close(client_fd);
+            metrics_add(METRIC_ACTIVE, -1);
+            return -1;
+        }
+
+        if (reap_threads(acceptor, false) != 0)
+        {
+            return -1;
+        }
+    }
+
+    // Stop accepting, connections still waiting in the backlog are reset
+    shutdown(acceptor->server_fd, SHUT_RD);
+    return drain_threads(acceptor);
+}
+
+static int acceptor_run(struct acceptor *acceptor)
+{
+#ifdef USE_IO_URING
+    if (acceptor->use_io_uring) {
+        if (uring_server_run(acceptor->server_fd, acceptor->data_file_mutex) == 0) {
+            return 0;
+        }
+        log_msg(LOG_WARNING, "io_uring unavailable (%s), using a thread per connection", strerror(errno));
+    }
+#else
+    if (acceptor->use_io_uring) {
+        log_msg(LOG_WARNING, "Built without io_uring support, using a thread per connection");
+    }
+#endif
+    return thread_server_run(acceptor);
+}
+
+static void* acceptor_thread_func(void *arg)
+{
+    struct acceptor *acceptor = (struct acceptor *)arg;
+    cpu_set_t cpus;
+
+    // Connection threads inherit the affinity, so everything accepted here stays on this CPU
+    if (acceptor->cpu >= 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(acceptor->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        {
+            log_msg(LOG_WARNING, "Couldn't pin acceptor to CPU %d", acceptor->cpu);
+        }
+    }
+
+    acceptor->retval = acceptor_run(acceptor);
+    return NULL;
+}
+
+static int open_server_socket(bool reuse_port)
+{
+    struct sockaddr_in server_addr;
+    int optval = 1;
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd == -1) {
-        syslog(LOG_ERR, "socket() failed: %s", strerror(errno));
+        log_msg(LOG_ERR, "socket() failed: %s", strerror(errno));
         return -1;
     }
 
-    int optval = 1;
     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == -1) {
+        log_msg(LOG_ERR, "setsockopt(SO_REUSEPORT) failed: %s", strerror(errno));
+        close(server_fd);
+        return -1;
+    }
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -313,84 +738,239 @@ int main(int argc, char *argv[]) {
     server_addr.sin_addr.s_addr = INADDR_ANY;
 
     if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        syslog(LOG_ERR, "bind() failed: %s", strerror(errno));
+        log_msg(LOG_ERR, "bind() failed: %s", strerror(errno));
         close(server_fd);
         return -1;
     }
 
-    if (argc == 2 && strcmp(argv[1], "-d") == 0) {
-        daemonize();
-    }
+    return server_fd;
+}
 
-    if (listen(server_fd, 10) == -1) {
-        syslog(LOG_ERR, "listen() failed: %s", strerror(errno));
-        close(server_fd);
-        return -1;
+/**
+ * Runs @param count acceptors on their own threads and waits for SIGINT/SIGTERM.
+ * @return 0 if every acceptor stopped cleanly, -1 otherwise
+ */
+static int run_acceptors(struct acceptor *acceptors, int count)
+{
+    sigset_t old_mask;
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    int started = 0;
+    int retval = 0;
+
+    if (cpu_count < 1) {
+        cpu_count = 1;
     }
 
-#ifndef USE_AESD_CHAR_DEVICE
-    pthread_t timestamp_thread;
-    if (pthread_create(&timestamp_thread, NULL, timestamp_thread_func, &data_file_mutex) != 0)
-    {
-        syslog(LOG_ERR, "pthread_create timestamp thread failed");
-        return -1;
+    // Signals are taken by this thread only, the acceptors are woken explicitly below
+    block_exit_signals(&old_mask);
+
+    for (started = 0; started < count; ++started) {
+        acceptors[started].cpu = count > 1 ? started % cpu_count : -1;
+        if (pthread_create(&acceptors[started].thread_id, NULL, acceptor_thread_func, &acceptors[started]) != 0) {
+            log_msg(LOG_ERR, "pthread_create acceptor failed");
+            exit_requested = 1;
+            retval = -1;
+            break;
+        }
     }
-#endif
 
     while (!exit_requested) {
-        client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-        if (client_fd == -1) {
-            if (errno == EINTR)
-            {
-                continue;
-            }
-            syslog(LOG_ERR, "accept() failed: %s", strerror(errno));
-            return -1;
+        sigsuspend(&old_mask);
+    }
+
+    // shutdown() fails any accept() still blocked, the signal covers one that's about to block
+    for (int i = 0; i < started; ++i) {
+        shutdown(acceptors[i].server_fd, SHUT_RDWR);
+        pthread_kill(acceptors[i].thread_id, SIGUSR1);
+    }
+
+    for (int i = 0; i < started; ++i) {
+        if (pthread_join(acceptors[i].thread_id, NULL) != 0) {
+            log_msg(LOG_ERR, "pthread_join acceptor failed");
+            retval = -1;
+        } else if (acceptors[i].retval != 0) {
+            retval = -1;
         }
+    }
 
-        thread_data = (struct thread_data *)malloc(sizeof(struct thread_data));
-        if (thread_data == NULL)
-        {
-            syslog(LOG_ERR, "malloc failed");
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return retval;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-d] [-q] [-v] [-u] [-a acceptors] [-b backlog] [-t drain_seconds]\n"
+            "       [-o max_output_bytes] [-w send_timeout_seconds] [-m socket]\n", name);
+    fprintf(stderr, "  -d  run as a daemon\n");
+    fprintf(stderr, "  -q  don't log every accepted and closed connection\n");
+    fprintf(stderr, "  -v  log debug messages too\n");
+    fprintf(stderr, "  -u  serve connections from an io_uring event loop, falling back to a thread\n");
+    fprintf(stderr, "      per connection when io_uring isn't available\n");
+    fprintf(stderr, "  -a  number of acceptor threads, each with its own SO_REUSEPORT socket and\n");
+    fprintf(stderr, "      pinned to a CPU when there's more than one (default 1)\n");
+    fprintf(stderr, "  -b  listen() backlog of each socket (default %d)\n", DEFAULT_BACKLOG);
+    fprintf(stderr, "  -t  seconds connections in flight get to finish on SIGINT/SIGTERM (default %d)\n",
+            DEFAULT_DRAIN_SECONDS);
+    fprintf(stderr, "  -o  with -u, most bytes a client may leave unsent before further replies are\n"
+            "      refused, 0 for no limit, a single reply is always sent (default %d).\n"
+            "      A thread per connection only ever has one reply to send, so it's never\n"
+            "      refused there\n",
+            DEFAULT_MAX_OUTPUT_BYTES);
+    fprintf(stderr, "  -w  seconds a client may stop reading before it's dropped, 0 to wait\n");
+    fprintf(stderr, "      forever (default %d)\n", DEFAULT_SEND_TIMEOUT_SECONDS);
+    fprintf(stderr, "  -m  serve counters and histograms in the Prometheus text format on this\n");
+    fprintf(stderr, "      Unix socket\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct acceptor *acceptors = NULL;
+    pthread_mutex_t data_file_mutex = {0};
+    const char *metrics_socket = NULL;
+    sigset_t old_mask;
+    bool run_as_daemon = false;
+    bool use_io_uring = false;
+    int acceptor_count = 1;
+    int backlog = DEFAULT_BACKLOG;
+    int opt;
+    int retval = -1;
+    int opened = 0;
+
+    while ((opt = getopt(argc, argv, "dqvua:b:t:o:w:m:")) != -1) {
+        switch (opt) {
+        case 'd':
+            run_as_daemon = true;
+            break;
+        case 'q':
+            log_connections = false;
+            break;
+        case 'v':
+            log_level = LOG_DEBUG;
+            break;
+        case 'u':
+            use_io_uring = true;
+            break;
+        case 'a':
+            acceptor_count = atoi(optarg);
+            if (acceptor_count < 1) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            if (backlog < 1) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 't':
+            drain_timeout_seconds = atoi(optarg);
+            if (drain_timeout_seconds < 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'o':
+            max_output_bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            send_timeout_seconds = atoi(optarg);
+            if (send_timeout_seconds < 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'm':
+            metrics_socket = optarg;
+            break;
+        default:
+            usage(argv[0]);
             return -1;
         }
-        memset(thread_data, 0, sizeof(struct thread_data));
+    }
 
-        thread_data->socket_fd = client_fd;
-        thread_data->client_addr = client_addr.sin_addr;
-        thread_data->data_file_mutex = &data_file_mutex;
-        SLIST_INSERT_HEAD(&threads, thread_data, next);
+    openlog("aesdsocket", LOG_PID, LOG_USER);
+    setup_signal_handling();
+    pthread_mutex_init(&data_file_mutex, NULL);
 
-        if (pthread_create(&thread_data->thread_id, NULL, thread_func, thread_data) != 0)
-        {
-            syslog(LOG_ERR, "pthread_create failed");
-            return -1;
+    replay_cache = replay_cache_create();
+    if (replay_cache == NULL) {
+        return -1;
+    }
+
+    acceptors = calloc(acceptor_count, sizeof(*acceptors));
+    if (acceptors == NULL) {
+        log_msg(LOG_ERR, "malloc failed");
+        return -1;
+    }
+
+    // Every socket is bound before daemonizing so a port conflict is still reported to the caller
+    for (opened = 0; opened < acceptor_count; ++opened) {
+        acceptors[opened].server_fd = open_server_socket(acceptor_count > 1);
+        if (acceptors[opened].server_fd == -1) {
+            goto cleanup;
         }
+        acceptors[opened].use_io_uring = use_io_uring;
+        acceptors[opened].data_file_mutex = &data_file_mutex;
+    }
 
-        struct thread_data *current = NULL, *next = NULL;
-        SLIST_FOREACH_SAFE(current, &threads, next, next)
-        {
-            if (current->is_finished)
-            {
-                syslog(LOG_INFO, "Thread %ld finished with %s", current->thread_id, current->success ? "success" : "failure");
-                SLIST_REMOVE(&threads, current, thread_data, next);
+    if (metrics_socket != NULL && metrics_listen(metrics_socket) != 0) {
+        goto cleanup;
+    }
 
-                if (pthread_join(current->thread_id, NULL) != 0)
-                {
-                    syslog(LOG_ERR, "pthread_join failed");
-                    return -1;
-                }
+    if (run_as_daemon) {
+        daemonize();
+    }
 
-                free(current);
-            }
+    // Like connection threads, the log and metrics threads must not take SIGINT/SIGTERM from the acceptors
+    block_exit_signals(&old_mask);
+    if (log_start() != 0 || (metrics_socket != NULL && metrics_start() != 0)) {
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        goto cleanup;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    for (int i = 0; i < acceptor_count; ++i) {
+        if (listen(acceptors[i].server_fd, backlog) == -1) {
+            log_msg(LOG_ERR, "listen() failed: %s", strerror(errno));
+            goto cleanup;
         }
     }
 
 #ifndef USE_AESD_CHAR_DEVICE
+    if (timestamp_timer_start(&data_file_mutex) != 0)
+    {
+        goto cleanup;
+    }
+#endif
+
+    /*
+     * A single acceptor gets its own thread too: a signal landing between its exit_requested check
+     * and accept() would otherwise go unnoticed until the next connection
+     */
+    if (acceptor_count > 1) {
+        log_msg(LOG_INFO, "Accepting on %d SO_REUSEPORT sockets", acceptor_count);
+    }
+    retval = run_acceptors(acceptors, acceptor_count);
+
+    if (retval != 0) {
+        goto cleanup;
+    }
+
+    // Every connection was drained, so nothing uses the cache anymore
+    replay_cache_destroy(replay_cache);
+#ifndef USE_AESD_CHAR_DEVICE
+    close(timestamp_timer_fd);
     unlink(DATA_FILE);
 #endif
 
-    close(server_fd);
+cleanup:
+    metrics_stop();
+    for (int i = 0; i < opened; ++i) {
+        close(acceptors[i].server_fd);
+    }
+    free(acceptors);
+    log_stop();
     closelog();
-    return 0;
+    return retval == 0 ? 0 : -1;
 }
@@ -0,0 +1,320 @@
+/*
+ * aesdsocket.h
+ *
+ * Definitions shared between the aesdsocket server, its io_uring backend, the replay cache,
+ * the connection slab, the output queues, the metrics endpoint and the log ring.
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef USE_AESD_CHAR_DEVICE
+    #define DATA_FILE "/dev/aesdchar"
+#else
+    #define DATA_FILE "/var/tmp/aesdsocketdata"
+#endif
+
+#define SEEKTO_MAGIC "AESDCHAR_IOCSEEKTO:"
+
+/**
+ * Set by the SIGINT/SIGTERM handler, checked by the accept loops
+ */
+extern volatile sig_atomic_t exit_requested;
+
+/**
+ * Seconds connections in flight get to finish once exit was requested, see -t
+ */
+extern int drain_timeout_seconds;
+
+/**
+ * Least important syslog priority logged, LOG_INFO unless raised to LOG_DEBUG with -v
+ */
+extern int log_level;
+
+/**
+ * Logs like syslog() through the log ring, see aesdsocket-log.c.  Messages below log_level are
+ * dropped before their arguments are even evaluated.
+ */
+#define log_msg(priority, ...) \
+    do { \
+        if ((priority) <= log_level) { \
+            log_write((priority), __VA_ARGS__); \
+        } \
+    } while (0)
+
+void log_write(int priority, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Starts the thread handing logged messages to syslog(), until then log_write() calls syslog()
+ * directly.  Must be called after daemonizing, the thread wouldn't survive the fork.
+ * @return 0 on success, -1 on error
+ */
+int log_start(void);
+
+/**
+ * Stops the log thread once it logged every message still in the ring, later messages go to
+ * syslog() directly again
+ */
+void log_stop(void);
+
+/**
+ * Whether every accepted and closed connection is logged, cleared by -q
+ */
+extern bool log_connections;
+
+/**
+ * timerfd which becomes readable whenever a timestamp record is due in DATA_FILE, or -1 when
+ * there are no timestamps (the char device build).  Accept loops wait on it alongside their
+ * listening socket and call timestamp_tick() when it's readable.
+ */
+extern int timestamp_timer_fd;
+void timestamp_tick(void);
+
+/**
+ * Reference counted piece of the replay cache: one chunk of the char device mirror, or one mapping
+ * of the regular file.  Its bytes up to the cached size never change, so a reply can keep sending
+ * from them after the data file mutex was released, while the cache moves on to other blocks.
+ */
+struct replay_block;
+
+void replay_block_get(struct replay_block *block);
+
+/**
+ * Drops a reference, freeing or unmapping the block with the last one.  Safe without the data
+ * file mutex.
+ */
+void replay_block_put(struct replay_block *block);
+
+/**
+ * @param len bytes at @param data, which lie in @param block and hold a reference to it
+ */
+struct output_segment
+{
+    struct replay_block *block;
+    const char *data;
+    size_t len;
+};
+
+/**
+ * Replies waiting to be sent to a client, see aesdsocket-output.c.  Kept with the connection state
+ * and recycled along with it.
+ */
+struct output_queue
+{
+    struct output_segment *segments;
+    size_t capacity;
+    size_t count;
+    // First segment not completely sent yet, and how much of it was
+    size_t first;
+    size_t offset;
+    // Bytes queued and not sent yet
+    size_t length;
+};
+
+#define DEFAULT_MAX_OUTPUT_BYTES (64 * 1024 * 1024)
+#define DEFAULT_SEND_TIMEOUT_SECONDS 30
+// Segments handed to a single sendmsg(), well under IOV_MAX
+#define OUTPUT_MAX_IOVECS 64
+
+/**
+ * Most bytes a client may leave unsent before further replies to it are refused, 0 for no limit,
+ * see -o.  Only the io_uring backend queues more than one reply per connection, so it's the only
+ * one this ever refuses anything in.
+ */
+extern size_t max_output_bytes;
+
+/**
+ * Seconds a client may go without reading anything before it's dropped, 0 to wait forever, see -w
+ */
+extern int send_timeout_seconds;
+
+/**
+ * Checks a reply of @param len bytes may be queued behind what @param queue holds.  A reply to an
+ * empty queue always may, however large, max_output_bytes only limits the unsent backlog.
+ * @return 0 if it may, -1 if it would exceed max_output_bytes
+ */
+int output_queue_admit(struct output_queue *queue, size_t len);
+
+/**
+ * Queues @param len bytes at @param data, which lie in @param block, taking a reference to it
+ * @return 0 on success, -1 if allocation failed
+ */
+int output_queue_push(struct output_queue *queue, struct replay_block *block, const char *data, size_t len);
+
+/**
+ * Fills @param iov with up to @param max_iov of the unsent segments at the front of @param queue,
+ * for a sendmsg() followed by output_queue_consume()
+ * @return the number of iovecs filled, 0 once the queue is empty.  @param more is set when
+ * segments are left over, for MSG_MORE.
+ */
+int output_queue_iov(struct output_queue *queue, struct iovec *iov, int max_iov, bool *more);
+
+/**
+ * Marks @param len bytes at the front of @param queue sent, dropping the segments done with
+ */
+void output_queue_consume(struct output_queue *queue, size_t len);
+
+/**
+ * Drops everything in @param queue, keeping its segment array for the next connection
+ */
+void output_queue_clear(struct output_queue *queue);
+
+/**
+ * Sends everything in @param queue to @param client_fd with non-blocking sends, waiting up to
+ * send_timeout_seconds whenever the client stops reading.  Never call it with a lock held.
+ * @return 0 once the queue was sent and emptied, -1 on error, a timeout or a signal, in which
+ * case the rest is still queued
+ */
+int output_queue_flush(struct output_queue *queue, int client_fd);
+
+/**
+ * In-memory mirror of DATA_FILE, see aesdsocket-cache.c.  None of the functions lock,
+ * callers serialize on the data file mutex.
+ */
+struct replay_cache;
+
+/**
+ * @return an empty cache, DATA_FILE is opened on first use.  NULL if allocation failed.
+ */
+struct replay_cache *replay_cache_create(void);
+void replay_cache_destroy(struct replay_cache *cache);
+
+/**
+ * Appends the @param iovcnt buffers at @param iov to DATA_FILE and to the mirror.  They go to a
+ * regular file with a single writev(), the char device gets one write() per buffer.
+ * @return 0 once the data is in DATA_FILE, -1 on error
+ */
+int replay_cache_append(struct replay_cache *cache, const struct iovec *iov, int iovcnt);
+
+/**
+ * Queues the current contents of DATA_FILE from byte @param offset on in @param queue, pinning the
+ * blocks of the cache they lie in rather than copying them.  The mirror is reloaded first if it
+ * went stale.
+ * @return the number of bytes queued, -1 on error or if output_queue_admit() refused them
+ */
+ssize_t replay_cache_pin(struct replay_cache *cache, struct output_queue *queue, size_t offset);
+
+/**
+ * Appends the @param packet_size byte @param packet to DATA_FILE and queues the contents it leaves
+ * behind in @param output, both under @param data_file_mutex.  Shared by the thread per connection
+ * and io_uring servers, so every append and replay goes through the same lock and cache.
+ * @return true on success
+ */
+bool append_and_stage(pthread_mutex_t *data_file_mutex, const char *packet, size_t packet_size,
+                      struct output_queue *output);
+
+/**
+ * Queues the data file contents from the position requested by the seekto @param packet in
+ * @param output, under @param data_file_mutex
+ * @return true on success
+ */
+bool do_seek_to(pthread_mutex_t *data_file_mutex, const char *packet, struct output_queue *output);
+
+// Smallest receive buffer, and the largest one kept when its connection is recycled
+#define BUFFER_MIN_CAPACITY 1024
+#define BUFFER_MAX_RETAINED (64 * 1024)
+
+/**
+ * Recycles fixed size objects through a free list, see aesdsocket-slab.c.  Not thread safe,
+ * each acceptor or io_uring loop owns its own.
+ */
+struct slab
+{
+    size_t object_size;
+    void *free_list;
+    void *blocks;
+};
+
+void slab_init(struct slab *slab, size_t object_size);
+
+/**
+ * @return an object of the slab's object_size, zeroed the first time it's handed out and
+ * otherwise holding whatever it held when freed.  NULL if allocation failed.
+ */
+void *slab_alloc(struct slab *slab);
+void slab_free(struct slab *slab, void *object);
+
+/**
+ * Frees all memory of the slab, calling @param release (when not NULL) on every object first.
+ * Only valid once every object was freed.
+ */
+void slab_destroy(struct slab *slab, void (*release)(void *object));
+
+/**
+ * Grows *@param buffer to hold at least @param size bytes, doubling *@param capacity so data
+ * arriving in many pieces is only moved a few times.
+ * @return 0 on success, -1 if allocation failed, leaving the buffer untouched
+ */
+int buffer_reserve(char **buffer, size_t *capacity, size_t size);
+
+/**
+ * Frees a buffer about to be reused by another connection if it grew past BUFFER_MAX_RETAINED
+ */
+void buffer_recycle(char **buffer, size_t *capacity);
+
+/**
+ * Counters and histograms served by the metrics endpoint, see aesdsocket-metrics.c.  Updates are
+ * lock free and safe from any thread.
+ */
+enum metrics_counter
+{
+    METRIC_ACCEPTED,
+    METRIC_ACTIVE,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRICS_COUNTERS
+};
+
+enum metrics_histogram
+{
+    HISTOGRAM_CONNECTION_US,
+    HISTOGRAM_LOCK_WAIT_US,
+    HISTOGRAM_REPLAY_BYTES,
+    METRICS_HISTOGRAMS
+};
+
+void metrics_add(enum metrics_counter counter, int64_t delta);
+void metrics_observe(enum metrics_histogram histogram, uint64_t value);
+
+/**
+ * @return microseconds on CLOCK_MONOTONIC, for the _US histograms
+ */
+uint64_t metrics_now_us(void);
+
+/**
+ * Binds the metrics endpoint to the Unix socket at @param path, replacing whatever is there
+ * @return 0 on success, -1 on error
+ */
+int metrics_listen(const char *path);
+
+/**
+ * Starts the thread answering every connection to the endpoint with the current metrics
+ * @return 0 on success, -1 on error
+ */
+int metrics_start(void);
+
+/**
+ * Stops the metrics thread, if any, and removes the socket
+ */
+void metrics_stop(void);
+
+#ifdef USE_IO_URING
+/**
+ * Serves connections accepted on @param server_fd from an io_uring event loop on the calling
+ * thread until exit_requested is set. Each acceptor thread runs its own ring, appends and replays
+ * go through @param data_file_mutex like the connection threads'.
+ * @return 0 once exit was requested, or -1 if io_uring isn't available and nothing was served,
+ * in which case the caller should fall back to the thread per connection server.
+ */
+int uring_server_run(int server_fd, pthread_mutex_t *data_file_mutex);
+#endif
+
+#endif /* AESDSOCKET_H */
@@ -0,0 +1,85 @@
+#!/bin/sh
+# Checks aesdsocket survives clients hanging up before their reply is written: metrics clients
+# which connect and close right away, and clients which send a packet and reset the connection
+# without reading the replay.  Either used to kill the server with SIGPIPE.
+#
+# Usage: hangup-test.sh [AESDSOCKET] [cycles]
+#   Runs AESDSOCKET (default ./aesdsocket) in the foreground on port 9000, so no other instance
+#   may be running.  Build it with USE_AESD_CHAR_DEVICE=0 unless aesdchar is loaded.  Needs
+#   python3 for the clients.
+
+set -e
+set -u
+
+AESDSOCKET=${1:-./aesdsocket}
+CYCLES=${2:-500}
+METRICS=$(mktemp -u /tmp/aesdsocket-metrics.XXXXXX)
+
+"$AESDSOCKET" -q -m "$METRICS" &
+pid=$!
+trap 'kill $pid 2>/dev/null; wait $pid 2>/dev/null; rm -f "$METRICS"' EXIT
+
+fail() {
+	status=0
+	wait $pid || status=$?
+	echo "FAIL: aesdsocket stopped answering after clients hung up, exit status ${status}"
+	exit 1
+}
+
+# Whether a hangup beats the server to its write is down to timing, hence the many cycles
+if ! python3 - "$METRICS" "$CYCLES" <<'CLIENTS'
+import socket, sys, time
+
+path, cycles = sys.argv[1], int(sys.argv[2])
+deadline = time.time() + 5
+while True:
+    try:
+        socket.create_connection(("127.0.0.1", 9000)).close()
+        break
+    except OSError:
+        if time.time() > deadline:
+            sys.exit("aesdsocket didn't start")
+        time.sleep(0.05)
+
+# Grow the data file so replays don't fit in the socket buffers
+for _ in range(16):
+    s = socket.create_connection(("127.0.0.1", 9000))
+    s.sendall(b"x" * 65535 + b"\n")
+    while s.recv(65536):
+        pass
+    s.close()
+
+for _ in range(cycles):
+    m = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    m.connect(path)
+    m.close()
+
+for _ in range(cycles):
+    s = socket.create_connection(("127.0.0.1", 9000))
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, b"\1\0\0\0\0\0\0\0")
+    s.sendall(b"hangup\n")
+    s.close()
+CLIENTS
+then
+	fail
+fi
+
+# A dead server still passes kill -0 until it's waited for, so check it still answers instead
+sleep 1
+if ! python3 - "$METRICS" <<'SCRAPE'
+import socket, sys
+
+m = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+m.connect(sys.argv[1])
+text = b""
+while True:
+    chunk = m.recv(65536)
+    if not chunk:
+        break
+    text += chunk
+sys.exit(b"aesdsocket_connections_accepted_total" not in text)
+SCRAPE
+then
+	fail
+fi
+echo "PASS: aesdsocket survived ${CYCLES} early hangups on each socket"
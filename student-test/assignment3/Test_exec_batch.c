@@ -0,0 +1,84 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+static char *const sleep_then_fail[] = { "/bin/sh", "-c", "sleep 0.2; exit 3", NULL };
+static char *const succeed[] = { "/bin/sh", "-c", "exit 0", NULL };
+static char *const killed[] = { "/bin/sh", "-c", "kill -9 $$", NULL };
+static char *const missing[] = { "/nonexistent/command", NULL };
+static char *const true_command[] = { "/bin/true", NULL };
+
+/**
+ * Runs a batch mixing slow, failing, killed and missing commands with @param max_parallel of them
+ * at a time, and checks every status ends up with the right command
+ */
+static void check_batch_statuses(int max_parallel)
+{
+    struct exec_batch_command commands[] = {
+        { .argv = sleep_then_fail },
+        { .argv = succeed },
+        { .argv = killed },
+        { .argv = missing },
+        { .argv = true_command },
+        { .argv = succeed },
+    };
+    size_t count = sizeof(commands) / sizeof(commands[0]);
+
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_batch(commands, count, max_parallel),
+                              "do_exec_batch succeeded although commands failed");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, commands[0].status, "Wrong status for the command exiting with 3");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, commands[1].status, "Wrong status for a successful command");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(128 + 9, commands[2].status, "Wrong status for the command killed by SIGKILL");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, commands[3].status, "Wrong status for a command which couldn't be started");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, commands[4].status, "Wrong status for a successful command");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, commands[5].status, "Wrong status for a successful command");
+}
+
+void test_exec_batch_statuses()
+{
+    check_batch_statuses(1);
+    check_batch_statuses(2);
+    check_batch_statuses(16);
+}
+
+void test_exec_batch_all_succeed()
+{
+    struct exec_batch_command commands[32];
+
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i)
+    {
+        commands[i].argv = true_command;
+    }
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_batch(commands, sizeof(commands) / sizeof(commands[0]), 4),
+                             "do_exec_batch failed although every command succeeded");
+    TEST_ASSERT_TRUE(do_exec_batch(commands, 0, 4));
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_batch(commands, 1, 0), "do_exec_batch accepted max_parallel 0");
+}
+
+/**
+ * Without a descriptor to spare for a pidfd, do_exec_batch() waits for the oldest command instead,
+ * the path it takes on kernels without pidfd_open().  The descriptor limit is lowered so only the
+ * epoll instance fits.
+ */
+void test_exec_batch_without_pidfd()
+{
+    struct rlimit saved;
+    struct rlimit limit;
+    int lowest_free = dup(0);
+
+    TEST_ASSERT_TRUE(lowest_free >= 0);
+    close(lowest_free);
+    TEST_ASSERT_EQUAL_INT(0, getrlimit(RLIMIT_NOFILE, &saved));
+    limit = saved;
+    limit.rlim_cur = lowest_free + 1;
+    TEST_ASSERT_EQUAL_INT(0, setrlimit(RLIMIT_NOFILE, &limit));
+
+    check_batch_statuses(1);
+    check_batch_statuses(3);
+
+    TEST_ASSERT_EQUAL_INT(0, setrlimit(RLIMIT_NOFILE, &saved));
+}
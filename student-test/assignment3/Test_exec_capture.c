@@ -0,0 +1,112 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+#define INTERLEAVED_LINES 2000
+// More than a pipe buffer on each stream, which deadlocks unless both are drained together
+#define FLOOD_BYTES "300000"
+
+void test_exec_capture_both_streams()
+{
+    struct exec_capture out = { 0 };
+    struct exec_capture err = { 0 };
+
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_capture(&out, &err, 3, "/bin/sh", "-c", "echo out; echo err >&2"),
+                             "do_exec_capture failed for a successful command");
+    TEST_ASSERT_EQUAL_STRING("out\n", out.buffer);
+    TEST_ASSERT_EQUAL_STRING("err\n", err.buffer);
+    TEST_ASSERT_FALSE(out.truncated);
+    TEST_ASSERT_FALSE(err.truncated);
+    free(out.buffer);
+    free(err.buffer);
+
+    // Output captured before a failure is kept
+    memset(&out, 0, sizeof(out));
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_capture(&out, NULL, 3, "/bin/sh", "-c", "echo partial; exit 2"),
+                              "do_exec_capture succeeded for a failing command");
+    TEST_ASSERT_EQUAL_STRING("partial\n", out.buffer);
+    free(out.buffer);
+}
+
+void test_exec_capture_interleaved()
+{
+    struct exec_capture out = { 0 };
+    struct exec_capture err = { 0 };
+    char script[128];
+    char expected[32];
+    char *line;
+
+    snprintf(script, sizeof(script), "i=0; while [ $i -lt %d ]; do echo out$i; echo err$i >&2; i=$((i+1)); done",
+             INTERLEAVED_LINES);
+    TEST_ASSERT_TRUE(do_exec_capture(&out, &err, 3, "/bin/sh", "-c", script));
+    line = out.buffer;
+    for (int i = 0; i < INTERLEAVED_LINES; ++i)
+    {
+        snprintf(expected, sizeof(expected), "out%d\n", i);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, strncmp(line, expected, strlen(expected)), "stdout lines out of order");
+        line += strlen(expected);
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE('\0', *line, "stdout has extra output");
+    TEST_ASSERT_EQUAL_INT(line - out.buffer, out.length);
+
+    line = err.buffer;
+    for (int i = 0; i < INTERLEAVED_LINES; ++i)
+    {
+        snprintf(expected, sizeof(expected), "err%d\n", i);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, strncmp(line, expected, strlen(expected)), "stderr lines out of order");
+        line += strlen(expected);
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE('\0', *line, "stderr has extra output");
+    free(out.buffer);
+    free(err.buffer);
+
+    memset(&out, 0, sizeof(out));
+    memset(&err, 0, sizeof(err));
+    TEST_ASSERT_TRUE(do_exec_capture(&out, &err, 3, "/bin/sh", "-c",
+                                     "head -c " FLOOD_BYTES " /dev/zero >&2; head -c " FLOOD_BYTES " /dev/zero"));
+    TEST_ASSERT_EQUAL_INT(atoi(FLOOD_BYTES), out.length);
+    TEST_ASSERT_EQUAL_INT(atoi(FLOOD_BYTES), err.length);
+    free(out.buffer);
+    free(err.buffer);
+}
+
+/*
+ * Output past the limit is read and thrown away, so a command writing far more than is kept
+ * still runs to completion
+ */
+void test_exec_capture_limit()
+{
+    struct exec_capture out = { .limit = 10 };
+    struct exec_capture err = { .limit = 4 };
+
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_capture(&out, &err, 3, "/bin/sh", "-c",
+                                             "echo short >&2; head -c 1000000 /dev/zero | tr '\\0' x"),
+                             "Command writing past the limit didn't complete");
+    TEST_ASSERT_EQUAL_INT(10, out.length);
+    TEST_ASSERT_EQUAL_STRING("xxxxxxxxxx", out.buffer);
+    TEST_ASSERT_TRUE_MESSAGE(out.truncated, "Output past the limit wasn't reported");
+    TEST_ASSERT_EQUAL_STRING("shor", err.buffer);
+    TEST_ASSERT_TRUE(err.truncated);
+    free(out.buffer);
+    free(err.buffer);
+}
+
+void test_exec_capture_caller_buffer()
+{
+    char buffer[8];
+    struct exec_capture out = { .buffer = buffer, .capacity = sizeof(buffer) };
+
+    TEST_ASSERT_TRUE(do_exec_capture(&out, NULL, 3, "/bin/sh", "-c", "echo 0123456789"));
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(buffer, out.buffer, "Caller supplied buffer was replaced");
+    TEST_ASSERT_EQUAL_INT(sizeof(buffer) - 1, out.length);
+    TEST_ASSERT_EQUAL_STRING("0123456", buffer);
+    TEST_ASSERT_TRUE(out.truncated);
+
+    // The buffer is reset for the next command
+    TEST_ASSERT_TRUE(do_exec_capture(&out, NULL, 2, "/bin/echo", "ok"));
+    TEST_ASSERT_EQUAL_STRING("ok\n", buffer);
+    TEST_ASSERT_FALSE(out.truncated);
+}
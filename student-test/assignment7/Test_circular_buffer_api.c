@@ -0,0 +1,38 @@
+#include "unity.h"
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+#include "circular-buffer-cases.h"
+
+/**
+ * Circular buffer API checks against the default storage, where entries stay in the caller's memory
+ * and only small ones are copied inline.  Test_circular_buffer_byte_ring.c runs the same checks
+ * against the AESD_BYTE_RING storage.
+ */
+void test_circular_buffer_api_wrap()
+{
+    cases_wrap();
+}
+
+void test_circular_buffer_api_eviction()
+{
+    cases_eviction();
+}
+
+void test_circular_buffer_api_growth()
+{
+    cases_growth();
+}
+
+void test_circular_buffer_api_spans()
+{
+    cases_spans();
+}
+
+void test_circular_buffer_api_load()
+{
+    cases_load();
+}
+
+void test_circular_buffer_api_reserve()
+{
+    cases_reserve();
+}
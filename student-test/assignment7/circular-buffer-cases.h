@@ -0,0 +1,303 @@
+/*
+ * circular-buffer-cases.h
+ *
+ * Checks of the circular buffer API shared by the test files for each storage engine.  Include
+ * it after aesd-circular-buffer.h, the checks hold whichever engine that was built with.
+ */
+
+#ifndef CIRCULAR_BUFFER_CASES_H
+#define CIRCULAR_BUFFER_CASES_H
+
+#include "unity.h"
+#include <stdio.h>
+#include <string.h>
+
+#define CASES_ENTRIES AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+#define CASES_EXTRA_ENTRIES 5
+#define CASES_GROWTH_STEP 1000
+
+/**
+ * Adds the @param size bytes at @param data as an entry which isn't inline
+ * @return what aesd_circular_buffer_add_entry() returned
+ */
+static const char *cases_add(struct aesd_circular_buffer *buffer, const char *data, size_t size)
+{
+    struct aesd_buffer_entry entry;
+
+    entry.buffptr = data;
+    entry.size = size;
+    return aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+ * Asserts entry @param index of @param buffer, counting from the oldest, holds @param size bytes
+ * equal to @param expected
+ */
+static void cases_assert_entry(struct aesd_circular_buffer *buffer, uint32_t index,
+                               const char *expected, size_t size)
+{
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_get_entry(buffer, index);
+
+    TEST_ASSERT_NOT_NULL_MESSAGE(entry, "Entry missing from the buffer");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(size, entry->size, "Entry has the wrong size");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expected, entry->buffptr, size, "Entry has the wrong contents");
+}
+
+/**
+ * Reads all of @param buffer through aesd_circular_buffer_find_span_for_fpos() and asserts it's
+ * the @param size bytes at @param expected
+ * @return the number of spans it took
+ */
+static int cases_assert_spans(struct aesd_circular_buffer *buffer, const char *expected, size_t size)
+{
+    size_t offset = 0;
+    int spans = 0;
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(size, aesd_circular_buffer_get_num_bytes(buffer),
+                                     "Buffer holds the wrong number of bytes");
+    while (offset < size)
+    {
+        size_t span_size = 0;
+        const char *span = aesd_circular_buffer_find_span_for_fpos(buffer, offset, &span_size);
+
+        TEST_ASSERT_NOT_NULL_MESSAGE(span, "No span at an offset within the buffer");
+        TEST_ASSERT_TRUE_MESSAGE(span_size > 0 && span_size <= size - offset, "Span has the wrong size");
+        TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expected + offset, span, span_size, "Span has the wrong contents");
+        offset += span_size;
+        spans++;
+    }
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_span_for_fpos(buffer, size, &offset),
+                             "Found a span past the end of the buffer");
+    return spans;
+}
+
+/*
+ * Adding more entries than the buffer holds drops the oldest ones, the rest are read back in order
+ */
+static void cases_wrap(void)
+{
+    struct aesd_circular_buffer buffer;
+    char data[CASES_ENTRIES + CASES_EXTRA_ENTRIES][16];
+    char expected[sizeof(data)];
+    size_t expected_size = 0;
+    size_t entry_offset = 0;
+    struct aesd_buffer_entry *entry;
+
+    aesd_circular_buffer_init(&buffer);
+    for (int i = 0; i < CASES_ENTRIES + CASES_EXTRA_ENTRIES; ++i)
+    {
+        snprintf(data[i], sizeof(data[i]), "write%d\n", i);
+        cases_add(&buffer, data[i], strlen(data[i]));
+    }
+
+    for (int i = 0; i < CASES_ENTRIES; ++i)
+    {
+        const char *contents = data[CASES_EXTRA_ENTRIES + i];
+
+        cases_assert_entry(&buffer, i, contents, strlen(contents));
+        memcpy(expected + expected_size, contents, strlen(contents));
+        expected_size += strlen(contents);
+    }
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_get_entry(&buffer, CASES_ENTRIES),
+                             "Found an entry past the newest one");
+    cases_assert_spans(&buffer, expected, expected_size);
+
+    // Offset 1 of the second oldest entry
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, strlen(data[CASES_EXTRA_ENTRIES]) + 1,
+                                                             &entry_offset);
+    TEST_ASSERT_EQUAL_PTR(aesd_circular_buffer_get_entry(&buffer, 1), entry);
+    TEST_ASSERT_EQUAL_UINT32(1, entry_offset);
+    TEST_ASSERT_EQUAL_INT32(strlen(data[CASES_EXTRA_ENTRIES]) + 1,
+                            aesd_circular_buffer_calculate_offset(&buffer, 1, 1));
+
+    aesd_circular_buffer_free_storage(&buffer);
+}
+
+/*
+ * add_entry hands back the memory the buffer no longer references: the overwritten entry's, or
+ * the added entry's when the buffer keeps copies.  Inline entries never need freeing.
+ */
+static void cases_eviction(void)
+{
+    struct aesd_circular_buffer buffer;
+    char data[CASES_ENTRIES + 1][16];
+    struct aesd_buffer_entry inline_entry;
+    const char *evicted;
+
+    aesd_circular_buffer_init(&buffer);
+    for (int i = 0; i < CASES_ENTRIES; ++i)
+    {
+        snprintf(data[i], sizeof(data[i]), "write%d\n", i);
+        evicted = cases_add(&buffer, data[i], strlen(data[i]));
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(AESD_CIRCULAR_BUFFER_COPIES_ENTRIES ? data[i] : NULL, evicted,
+                                      "Wrong memory handed back while the buffer fills up");
+    }
+
+    snprintf(data[CASES_ENTRIES], sizeof(data[CASES_ENTRIES]), "overwrite\n");
+    evicted = cases_add(&buffer, data[CASES_ENTRIES], strlen(data[CASES_ENTRIES]));
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(AESD_CIRCULAR_BUFFER_COPIES_ENTRIES ? data[CASES_ENTRIES] : data[0], evicted,
+                                  "Wrong memory handed back when the buffer is full");
+
+    // The inline entry overwrites write1, later ones overwrite it
+    strcpy(inline_entry.inline_buffer, "inline\n");
+    inline_entry.buffptr = inline_entry.inline_buffer;
+    inline_entry.size = strlen(inline_entry.inline_buffer);
+    evicted = aesd_circular_buffer_add_entry(&buffer, &inline_entry);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(AESD_CIRCULAR_BUFFER_COPIES_ENTRIES ? NULL : data[1], evicted,
+                                  "Wrong memory handed back for an inline entry");
+    memset(inline_entry.inline_buffer, 0, sizeof(inline_entry.inline_buffer));
+    cases_assert_entry(&buffer, CASES_ENTRIES - 1, "inline\n", strlen("inline\n"));
+
+    for (int i = 0; i < CASES_ENTRIES - 1; ++i)
+    {
+        cases_add(&buffer, data[0], strlen(data[0]));
+    }
+    evicted = cases_add(&buffer, data[0], strlen(data[0]));
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(AESD_CIRCULAR_BUFFER_COPIES_ENTRIES ? data[0] : NULL, evicted,
+                                  "Memory handed back when an inline entry was overwritten");
+
+    aesd_circular_buffer_free_storage(&buffer);
+}
+
+/*
+ * Entries growing well past the buffer's storage keep their contents while it wraps
+ */
+static void cases_growth(void)
+{
+    static char data[CASES_ENTRIES + CASES_EXTRA_ENTRIES][(CASES_ENTRIES + CASES_EXTRA_ENTRIES) * CASES_GROWTH_STEP];
+    static char expected[CASES_ENTRIES * sizeof(data[0])];
+    struct aesd_circular_buffer buffer;
+    int spans = 0;
+
+    aesd_circular_buffer_init(&buffer);
+    for (int i = 0; i < CASES_ENTRIES + CASES_EXTRA_ENTRIES; ++i)
+    {
+        int first = i < CASES_ENTRIES ? 0 : i + 1 - CASES_ENTRIES;
+        size_t expected_size = 0;
+
+        memset(data[i], 'a' + i, (i + 1) * CASES_GROWTH_STEP);
+        cases_add(&buffer, data[i], (i + 1) * CASES_GROWTH_STEP);
+
+        for (int j = first; j <= i; ++j)
+        {
+            cases_assert_entry(&buffer, j - first, data[j], (j + 1) * CASES_GROWTH_STEP);
+            memcpy(expected + expected_size, data[j], (j + 1) * CASES_GROWTH_STEP);
+            expected_size += (j + 1) * CASES_GROWTH_STEP;
+        }
+        spans = cases_assert_spans(&buffer, expected, expected_size);
+#ifdef AESD_BYTE_RING
+        TEST_ASSERT_TRUE_MESSAGE(spans <= 2, "Byte ring contents take more than two spans");
+#endif
+    }
+    (void)spans;
+
+    aesd_circular_buffer_free_storage(&buffer);
+}
+
+/*
+ * A span runs on into the following entries while they are stored back to back
+ */
+static void cases_spans(void)
+{
+    static const char contents[] = "abcdefghi";
+    struct aesd_circular_buffer buffer;
+    size_t span_size = 0;
+    const char *span;
+
+    aesd_circular_buffer_init(&buffer);
+    cases_add(&buffer, contents, 3);
+    cases_add(&buffer, contents + 3, 4);
+    cases_add(&buffer, contents + 7, 2);
+
+    span = aesd_circular_buffer_find_span_for_fpos(&buffer, 1, &span_size);
+    TEST_ASSERT_NOT_NULL(span);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(8, span_size, "Span didn't continue into the following entries");
+    TEST_ASSERT_EQUAL_MEMORY("bcdefghi", span, 8);
+
+    span = aesd_circular_buffer_find_span_for_fpos(&buffer, 5, &span_size);
+    TEST_ASSERT_NOT_NULL(span);
+    TEST_ASSERT_EQUAL_UINT32(4, span_size);
+    TEST_ASSERT_EQUAL_MEMORY("fghi", span, 4);
+
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_span_for_fpos(&buffer, 9, &span_size));
+
+    aesd_circular_buffer_free_storage(&buffer);
+}
+
+/*
+ * Loading replaces the contents, and the buffer carries on from where the loaded entries end
+ */
+static void cases_load(void)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[CASES_ENTRIES];
+    char data[CASES_ENTRIES][16];
+    const char *evicted;
+
+    aesd_circular_buffer_init(&buffer);
+    cases_add(&buffer, "old\n", 4);
+
+    for (int i = 0; i < CASES_ENTRIES; ++i)
+    {
+        snprintf(data[i], sizeof(data[i]), "load%d\n", i);
+        entries[i].buffptr = data[i];
+        entries[i].size = strlen(data[i]);
+    }
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_load(&buffer, entries, 3));
+    for (int i = 0; i < 3; ++i)
+    {
+        cases_assert_entry(&buffer, i, data[i], strlen(data[i]));
+    }
+    TEST_ASSERT_NULL(aesd_circular_buffer_get_entry(&buffer, 3));
+    cases_add(&buffer, "after\n", 6);
+    cases_assert_entry(&buffer, 3, "after\n", 6);
+
+    // A full load, the next add overwrites the oldest loaded entry
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_load(&buffer, entries, CASES_ENTRIES));
+    if (AESD_CIRCULAR_BUFFER_COPIES_ENTRIES)
+    {
+        data[1][0] = 'X';
+    }
+    evicted = cases_add(&buffer, "after\n", 6);
+    if (!AESD_CIRCULAR_BUFFER_COPIES_ENTRIES)
+    {
+        TEST_ASSERT_EQUAL_PTR(data[0], evicted);
+    }
+    cases_assert_entry(&buffer, 0, "load1\n", 6);
+    cases_assert_entry(&buffer, CASES_ENTRIES - 1, "after\n", 6);
+
+    aesd_circular_buffer_free_storage(&buffer);
+}
+
+/*
+ * Once reserved, an entry of that size is added without allocating
+ */
+static void cases_reserve(void)
+{
+    static char data[4 * CASES_GROWTH_STEP * CASES_ENTRIES];
+    struct aesd_circular_buffer buffer;
+#ifdef AESD_BYTE_RING
+    char *ring;
+#endif
+
+    aesd_circular_buffer_init(&buffer);
+    memset(data, 'r', sizeof(data));
+    cases_add(&buffer, "first\n", 6);
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_reserve(&buffer, sizeof(data)));
+#ifdef AESD_BYTE_RING
+    ring = buffer.ring;
+    TEST_ASSERT_NOT_NULL(ring);
+    TEST_ASSERT_TRUE(buffer.ring_size >= sizeof(data));
+#endif
+    cases_add(&buffer, data, sizeof(data));
+#ifdef AESD_BYTE_RING
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(ring, buffer.ring, "Adding a reserved entry reallocated the ring");
+#endif
+    cases_assert_entry(&buffer, 0, "first\n", 6);
+    cases_assert_entry(&buffer, 1, data, sizeof(data));
+
+    aesd_circular_buffer_free_storage(&buffer);
+}
+
+#endif /* CIRCULAR_BUFFER_CASES_H */